@@ -4,34 +4,613 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "efi_lib.h"
 
+// Translation tables use the 4KiB granule with 48 bit virtual addresses: 4 levels, L0-L3, indexed
+//   the same as x86_64 PML4/PDPT/PDT/PT. Addresses with the upper 16 bits set, i.e. the direct map
+//   and the higher half kernel, are translated from TTBR1_EL1; lower addresses from TTBR0_EL1.
+typedef struct {
+    uint64_t entries[512];
+} Page_Table;
+
+// Stage 1 descriptor bits
+enum {
+    VALID       = (1 << 0),
+    TABLE       = (1 << 1),  // Table descriptor at L0-L2, page descriptor at L3; clear for 1GiB/2MiB blocks
+    ATTR_INDEX  = (1 << 2),  // Bits 4-2: MAIR_EL1 attribute index
+    AP_USER     = (1 << 6),  // AP[1]: accessible from EL0
+    AP_READONLY = (1 << 7),  // AP[2]: read only
+    INNER_SHAREABLE = (3 << 8),
+    ACCESS_FLAG = (1 << 10), // Set so the first access doesn't fault
+    NOT_GLOBAL  = (1 << 11), // TLB entries are tagged with the current ASID
+};
+
+#define PRIV_EXECUTE_NEVER (1ULL << 53)    // PXN: not executable at EL1
+#define USER_EXECUTE_NEVER (1ULL << 54)    // UXN: not executable at EL0
+
+// Table descriptor bits. Tables are also read as pages through the recursive slot, so they have
+//   page attributes too: accessed, EL1 only, normal memory, not executable. Table descriptors
+//   ignore those bits.
+#define TABLE_FLAGS (VALID | TABLE | ACCESS_FLAG | INNER_SHAREABLE | PRIV_EXECUTE_NEVER | USER_EXECUTE_NEVER)
+
+#define HUGE_PAGE_SIZE 0x40000000   // 1GiB block, mapped from an L1 entry
+
+// MAIR_EL1 memory attributes, selected per page by ATTR_INDEX
+#define MAIR_NORMAL_WB  0   // 0xFF: Normal, inner & outer write back, read/write allocate
+#define MAIR_DEVICE     1   // 0x04: Device-nGnRE, for MMIO
+#define MAIR_NORMAL_NC  2   // 0x44: Normal, inner & outer non-cacheable, for write combining
+#define MAIR_VALUE 0x4404FFULL
+
+// TCR_EL1: T0SZ = T1SZ = 16 for 48 bit addresses, 4KiB granules, inner shareable & write back
+//   write allocate cacheable table walks for both halves. IPS is set from ID_AA64MMFR0_EL1.
+#define TCR_VALUE ((16ULL << 0)  | (1ULL << 8)  | (1ULL << 10) | (3ULL << 12) | (0ULL << 14) | \
+                   (16ULL << 16) | (1ULL << 24) | (1ULL << 26) | (3ULL << 28) | (2ULL << 30))
+#define TCR_IPS_SHIFT 32
+
+// SCTLR_EL1: RES1 bits (including SPAN, so PSTATE.PAN isn't set on exceptions), SP alignment
+//   checks and the instruction cache. The MMU (M) and data cache (C) are added when enabled.
+#define SCTLR_VALUE 0x30D01808ULL
+#define SCTLR_M     (1 << 0)
+#define SCTLR_C     (1 << 2)
+
+#define CPACR_FPEN  (3 << 20)   // Don't trap FP/SIMD instructions at EL0/EL1
+
 #define ARCH_COFF_MACHINE 0xaa64    // Machine type bytes for PE Coff Header
 
-// TODO:
-void arch_setup_and_call_kernel(Entry_Point entry, void *kernel_stack, uint32_t stack_size, 
+#define PHYS_PAGE_ADDR_MASK 0x0000FFFFFFFFF000  // 48 bit physical address limit, lowest 12 bits are for flags only
+
+// ---------------------
+// Global variables
+// ---------------------
+Page_Table *ttbr0_table = NULL; // Top level table for the lower half, e.g. identity mappings
+Page_Table *ttbr1_table = NULL; // Top level table for the upper half, direct map & kernel
+UINTN page_table_pages = 0;     // Pages allocated for page tables
+
+// ---------------------
+// Functions
+// ---------------------
+extern void *memset(void *dst, uint8_t c, uint64_t len);
+
+// Mask interrupts and wait for interrupt, forever
+void arch_cpu_halt(void) {
+    __asm__ __volatile__ ("msr daifset, #0xF\n" "1: wfi\n" "b 1b\n");
+}
+
+// =====================================================================
+// Update a running CRC32C value with the ARMv8 crc32c instructions, 8 
+//   bytes at a time; fall back to the lookup table without them
+// =====================================================================
+uint32_t arch_crc32c(uint32_t crc, void *buffer, uint64_t len) {
+    static int has_crc32 = -1;
+    if (has_crc32 < 0) {
+        uint64_t isar0 = 0;
+        __asm__ __volatile__ ("mrs %0, id_aa64isar0_el1" : "=r"(isar0));
+        has_crc32 = ((isar0 >> 16) & 0xF) != 0;   // ID_AA64ISAR0_EL1.CRC32[bits 19:16]
+    }
+    if (!has_crc32) return crc32c_update(crc, buffer, len);
+
+    uint8_t *p = buffer;
+    for (; len > 0 && ((uint64_t)p & 7); len--, p++)
+        __asm__ (".arch_extension crc\n" "crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"((uint32_t)*p));
+
+    for (; len >= 8; len -= 8, p += 8)
+        __asm__ (".arch_extension crc\n" "crc32cx %w0, %w0, %x1" : "+r"(crc) : "r"(*(uint64_t *)p));
+
+    for (; len > 0; len--, p++)
+        __asm__ (".arch_extension crc\n" "crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"((uint32_t)*p));
+
+    return crc;
+}
+
+// Read virtual counter, for measuring elapsed ticks
+uint64_t arch_read_timestamp(void) {
+    uint64_t count = 0;
+    __asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r"(count));
+    return count;
+}
+
+// ==========================================================================
+// Expand a bitmap font glyph to ARGB pixels in fg/bg colors with NEON, 8 
+//   pixels of a line at a time in 2 vectors of 4: broadcast the 8 pixels'
+//   bits to every lane, test each lane's bit (cmtst) to get a lane mask, 
+//   then select fg or bg with it (bsl). Pixels left over in fonts that 
+//   aren't a multiple of 8 wide are done one at a time.
+// ==========================================================================
+typedef uint32_t Pixels_4 __attribute__((vector_size(16), aligned(4), may_alias));
+
+void arch_expand_glyph(uint32_t *dst, uint32_t pitch, Bitmap_Font *font, uint8_t *glyph, 
+                       uint32_t fg, uint32_t bg) {
+    const Pixels_4 lanes_lo = {0x80, 0x40, 0x20, 0x10}, lanes_hi = {8, 4, 2, 1};
+    const Pixels_4 fg4 = (Pixels_4){0} + fg;
+    const Pixels_4 bg4 = (Pixels_4){0} + bg;
+    const uint32_t line_bytes = (font->width + 7) / 8;
+
+    for (uint32_t i = 0; i < font->height; i++, dst += pitch, glyph += line_bytes) {
+        uint64_t bits = glyph_line_bits(font, glyph);
+        uint32_t px = 0;
+        for (; px + 8 <= font->width; px += 8) {
+            Pixels_4 group = (Pixels_4){0} + (uint32_t)(bits >> (font->width - 8 - px));
+            Pixels_4 mask_lo = (Pixels_4)((group & lanes_lo) != 0);
+            Pixels_4 mask_hi = (Pixels_4)((group & lanes_hi) != 0);
+            *(Pixels_4 *)&dst[px]   = (fg4 & mask_lo) | (bg4 & ~mask_lo);
+            *(Pixels_4 *)&dst[px+4] = (fg4 & mask_hi) | (bg4 & ~mask_hi);
+        }
+        for (; px < font->width; px++)
+            dst[px] = bg ^ ((fg ^ bg) & -(uint32_t)((bits >> (font->width-1 - px)) & 1));
+    }
+}
+
+// ==========================================================================
+// Copy pixels to the framebuffer with STNP non-temporal store pairs, 64 
+//   bytes at a time where possible, so video memory isn't allocated in the
+//   caches or read. Stores are 16 byte aligned, which Device memory needs 
+//   when the framebuffer isn't write combining. Unaligned head & tail 
+//   pixels are copied one at a time.
+// ==========================================================================
+void arch_copy_to_framebuffer(uint32_t *dst, uint32_t *src, uint64_t pixels) {
+    for (; pixels > 0 && ((uint64_t)dst & 15); pixels--) *dst++ = *src++;
+
+    for (; pixels >= 16; pixels -= 16, dst += 16, src += 16)
+        __asm__ __volatile__ ("ldp q0, q1, [%1]\n"  "ldp q2, q3, [%1, #32]\n"
+                              "stnp q0, q1, [%0]\n" "stnp q2, q3, [%0, #32]\n"
+                              : : "r"(dst), "r"(src) : "v0", "v1", "v2", "v3", "memory");
+
+    for (; pixels >= 4; pixels -= 4, dst += 4, src += 4)
+        __asm__ __volatile__ ("ldr q0, [%1]\n" "str q0, [%0]\n" : : "r"(dst), "r"(src) : "v0", "memory");
+
+    for (; pixels > 0; pixels--) *dst++ = *src++;
+    __asm__ __volatile__ ("dsb st" : : : "memory");    // Finish framebuffer stores before later writes
+}
+
+// ======================================================================
+// Clean data cache lines for a range to the point of coherency, so it
+//   reads the same with the MMU & data cache off
+// ======================================================================
+void clean_dcache_range(uint64_t address, uint64_t size) {
+    uint64_t ctr = 0;
+    __asm__ __volatile__ ("mrs %0, ctr_el0" : "=r"(ctr));
+    const uint64_t line_size = 4ULL << ((ctr >> 16) & 0xF);    // CTR_EL0.DminLine, log2 of words
+
+    for (uint64_t line = address & ~(line_size-1); line < address + size; line += line_size)
+        __asm__ __volatile__ ("dc cvac, %0" : : "r"(line) : "memory");
+    __asm__ __volatile__ ("dsb sy" : : : "memory");
+}
+
+// ============================================================================
+// Set translation tables & MMU, do other arch specific settings, and call
+//   kernel. Stack and kernel parms are used through the direct map; only this
+//   function's code needs to be identity mapped, as it keeps running from its
+//   physical address after loading the new tables.
+// ============================================================================
+void arch_setup_and_call_kernel(Entry_Point entry, void *kernel_stack, uint32_t stack_size,
                                 Kernel_Parms *kparms) {
-    (void)entry, (void)kernel_stack, (void)stack_size, (void)kparms;
+    const uint64_t direct_map_base = kparms->direct_map_base;
+
+    // Physical address size for TCR_EL1.IPS, from ID_AA64MMFR0_EL1.PARange; capped at 48 bits
+    //   as 52 bit output addresses need a different descriptor format
+    uint64_t mmfr0 = 0;
+    __asm__ __volatile__ ("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+    const uint64_t tcr = TCR_VALUE | (min(mmfr0 & 0xF, 5) << TCR_IPS_SHIFT);
+
+    // The MMU is turned off while switching tables, as MAIR & TCR can't change under live
+    //   translations. With the MMU off data accesses aren't cached, so everything is kept in
+    //   registers, and instruction fetches need this code cleaned to memory.
+    const uint64_t trampoline = (uint64_t)arch_setup_and_call_kernel & ~(PAGE_SIZE-1);
+    clean_dcache_range(trampoline, 2 * PAGE_SIZE);
+
+    const uint64_t stack  = direct_map_base + (uint64_t)kernel_stack + stack_size;
+    const uint64_t kparms_address = direct_map_base + (uint64_t)kparms;
+
+    // Firmware may run at EL2; then the kernel runs at EL1 in AArch64, with EL1 access to the
+    //   timers and FP/SIMD, entering EL1 with interrupts masked and the MMU off.
+    // Then: load MAIR/TCR/TTBRs, flush TLB & instruction cache, enable the MMU & caches, set the
+    //   new stack, and call the kernel with kparms in X0.
+    __asm__ __volatile__ (
+        "msr daifset, #0xF\n"
+        "dsb ish\n"                 // Finish page table writes
+        "mrs x9, CurrentEL\n"
+        "cmp x9, #8\n"              // EL2
+        "b.ne 1f\n"
+
+        "mrs x9, sctlr_el2\n"
+        "bic x9, x9, #1\n"          // EL2 MMU & data cache off, before changing HCR_EL2.E2H
+        "bic x9, x9, #4\n"
+        "msr sctlr_el2, x9\n"
+        "isb\n"
+        "mov x9, #0x80000000\n"     // HCR_EL2.RW: EL1 is AArch64
+        "msr hcr_el2, x9\n"
+        "isb\n"
+        "mrs x9, cnthctl_el2\n"
+        "orr x9, x9, #3\n"          // EL1PCTEN, EL1PCEN: EL1 counter & timer access
+        "msr cnthctl_el2, x9\n"
+        "msr cntvoff_el2, xzr\n"
+        "mov x9, #0x33FF\n"         // CPTR_EL2 RES1 bits, no FP/SIMD traps
+        "msr cptr_el2, x9\n"
+        "msr sctlr_el1, %[sctlr_off]\n"
+        "mov x9, #0x3C5\n"          // SPSR: EL1h, DAIF masked
+        "msr spsr_el2, x9\n"
+        "adr x9, 2f\n"
+        "msr elr_el2, x9\n"
+        "eret\n"
+
+        "1:\n"
+        "msr sctlr_el1, %[sctlr_off]\n" // MMU & data cache off
+        "isb\n"
+
+        "2:\n"
+        "msr mair_el1, %[mair]\n"
+        "msr tcr_el1, %[tcr]\n"
+        "msr ttbr0_el1, %[ttbr0]\n"
+        "msr ttbr1_el1, %[ttbr1]\n"
+        "mov x9, %[cpacr]\n"
+        "msr cpacr_el1, x9\n"
+        "isb\n"
+        "tlbi vmalle1\n"
+        "ic iallu\n"
+        "dsb nsh\n"
+        "isb\n"
+        "msr sctlr_el1, %[sctlr_on]\n"  // MMU & caches on
+        "isb\n"
+
+        "mov sp, %[stack]\n"
+        "mov x0, %[kparms]\n"
+        "blr %[entry]\n"
+      :
+      : [sctlr_off]"r"(SCTLR_VALUE), [sctlr_on]"r"(SCTLR_VALUE | SCTLR_M | SCTLR_C),
+        [mair]"r"(MAIR_VALUE), [tcr]"r"(tcr), [ttbr0]"r"((uint64_t)ttbr0_table),
+        [ttbr1]"r"((uint64_t)ttbr1_table), [cpacr]"i"(CPACR_FPEN),
+        [stack]"r"(stack), [kparms]"r"(kparms_address), [entry]"r"((uint64_t)entry)
+      : "x0", "x9", "x30", "memory");
 }
 
-// TODO:
-void arch_cpu_halt(void) {
+// ======================================================================
+// Get the next level table from a table descriptor, allocating it if
+//   not valid. Permissions are only restricted at the last level.
+// ======================================================================
+Page_Table *next_page_table(Page_Table *table, uint64_t index, Page_Allocator *pa) {
+    if (!(table->entries[index] & VALID)) {
+        void *address = allocate_physical_pages(pa, 1);
+        if (!address) arch_cpu_halt();  // Out of memory for page tables, can't continue
+
+        memset(address, 0, sizeof(Page_Table));
+        table->entries[index] = (uint64_t)address | TABLE_FLAGS;
+        page_table_pages++;
+    }
+
+    return (Page_Table *)(table->entries[index] & PHYS_PAGE_ADDR_MASK);
+}
+
+// Get the top level table for a virtual address: TTBR1 for the upper half, else TTBR0
+Page_Table *root_table(uint64_t virtual_address) {
+    return (virtual_address >> 63) ? ttbr1_table : ttbr0_table;
+}
+
+// Is a descriptor a 1GiB/2MiB block, at L1/L2?
+bool is_block(uint64_t entry) {
+    return (entry & (VALID | TABLE)) == VALID;
 }
 
-// TODO:
-void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Memory_Map_Info *mmap) {
-    (void)physical_address, (void)virtual_address, (void)mmap;
+// Get block/page descriptor attributes for MAP_* flags
+uint64_t page_flags(uint32_t map_flags) {
+    uint64_t flags = VALID | ACCESS_FLAG | INNER_SHAREABLE;
+    if (!(map_flags & MAP_WRITE))   flags |= AP_READONLY;
+    if (map_flags & MAP_USER)       flags |= AP_USER;
+    if (!(map_flags & MAP_EXECUTE)) flags |= PRIV_EXECUTE_NEVER | USER_EXECUTE_NEVER;
+    else if (!(map_flags & MAP_USER)) flags |= USER_EXECUTE_NEVER;
+    if (!(map_flags & MAP_GLOBAL))  flags |= NOT_GLOBAL;
+
+    // Device memory is never executable, so instruction fetches can't be speculated from MMIO
+    if (map_flags & MAP_DEVICE)             flags |= (MAIR_DEVICE * ATTR_INDEX) | PRIV_EXECUTE_NEVER | USER_EXECUTE_NEVER;
+    else if (map_flags & MAP_WRITE_COMBINE) flags |= MAIR_NORMAL_NC * ATTR_INDEX;
+    else                                    flags |= MAIR_NORMAL_WB * ATTR_INDEX;
+    return flags;
 }
 
-// TODO:
+// ========================================================================
+// Map a range of memory with MAP_* flags. Walks the tables once per 2MiB
+//   of virtual addresses, and fills 4KiB page descriptors for that 2MiB in
+//   one loop. 1GiB and 2MiB blocks are used wherever physical & virtual
+//   addresses are aligned for them and the range covers the whole block.
+//   Parts already mapped are skipped.
+// ========================================================================
+void arch_map_range(uint64_t physical_address, uint64_t virtual_address, uint64_t size,
+                    uint32_t map_flags, Page_Allocator *pa) {
+    const uint64_t flags = page_flags(map_flags);
+
+    while (size > 0) {
+        uint64_t l0_index  = ((virtual_address) >> 39) & 0x1FF;   // 0-511
+        uint64_t l1_index  = ((virtual_address) >> 30) & 0x1FF;   // 0-511
+        uint64_t l2_index  = ((virtual_address) >> 21) & 0x1FF;   // 0-511
+        uint64_t l3_index  = ((virtual_address) >> 12) & 0x1FF;   // 0-511
+        uint64_t alignment = physical_address | virtual_address;
+        uint64_t step      = 0;    // Bytes mapped or skipped this time through
+
+        Page_Table *l1 = next_page_table(root_table(virtual_address), l0_index, pa);
+        if (size >= HUGE_PAGE_SIZE && !(alignment & (HUGE_PAGE_SIZE-1)) && !(l1->entries[l1_index] & VALID)) {
+            // Map a 1GiB block
+            l1->entries[l1_index] = (physical_address & PHYS_PAGE_ADDR_MASK) | flags;
+            step = HUGE_PAGE_SIZE;
+
+        } else if (is_block(l1->entries[l1_index])) {
+            step = HUGE_PAGE_SIZE - (virtual_address & (HUGE_PAGE_SIZE-1)); // Already mapped
+
+        } else {
+            Page_Table *l2 = next_page_table(l1, l1_index, pa);
+            if (size >= LARGE_PAGE_SIZE && !(alignment & (LARGE_PAGE_SIZE-1)) &&
+                !(l2->entries[l2_index] & VALID)) {
+                // Map a 2MiB block
+                l2->entries[l2_index] = (physical_address & PHYS_PAGE_ADDR_MASK) | flags;
+                step = LARGE_PAGE_SIZE;
+
+            } else if (is_block(l2->entries[l2_index])) {
+                step = LARGE_PAGE_SIZE - (virtual_address & (LARGE_PAGE_SIZE-1));  // Already mapped
+
+            } else {
+                // Fill 4KiB pages up to the end of this table or range
+                Page_Table *l3 = next_page_table(l2, l2_index, pa);
+                step = min(size, LARGE_PAGE_SIZE - (virtual_address & (LARGE_PAGE_SIZE-1)));
+
+                uint64_t entry = (physical_address & PHYS_PAGE_ADDR_MASK) | flags | TABLE;
+                for (uint64_t *pte = &l3->entries[l3_index];
+                     pte < &l3->entries[l3_index] + ((step + (PAGE_SIZE-1)) / PAGE_SIZE);
+                     pte++, entry += PAGE_SIZE) {
+                    if (!(*pte & VALID)) *pte = entry;
+                }
+            }
+        }
+
+        physical_address += step;
+        virtual_address  += step;
+        size -= min(size, step);
+    }
+}
+
+// ==================================================================
+// Map a virtual address to a physical address for a page of memory
+// ==================================================================
+void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Page_Allocator *pa) {
+    arch_map_range(physical_address, virtual_address, PAGE_SIZE, MAP_WRITE | MAP_EXECUTE | MAP_USER, pa);
+}
+
+// ========================================================================
+// Allocate the top level L1 tables for a range, without mapping anything.
+//   The L0 entries are then fixed, and lower tables can be allocated when
+//   the rest is mapped later.
+// ========================================================================
+void arch_reserve_range(uint64_t virtual_address, uint64_t size, Page_Allocator *pa) {
+    const uint64_t L0_ENTRY_SIZE = 1ULL << 39;  // 512GiB
+    const uint64_t end = virtual_address + size;
+
+    for (uint64_t address = virtual_address & ~(L0_ENTRY_SIZE-1); address < end; address += L0_ENTRY_SIZE)
+        next_page_table(root_table(address), (address >> 39) & 0x1FF, pa);
+}
+
+// ==========================================================================
+// Point an upper half L0 entry at the TTBR1 table itself, for the kernel's
+//   recursive table helpers. Read as a table descriptor at L0-L2 and a page
+//   descriptor at L3, like every other table descriptor through it.
+// ==========================================================================
+void arch_set_recursive_slot(uint64_t slot) {
+    ttbr1_table->entries[slot & 0x1FF] = (uint64_t)ttbr1_table | TABLE_FLAGS;
+}
+
+// Get number of pages allocated for page tables
+UINTN arch_page_table_pages(void) {
+    return page_table_pages;
+}
+
+// Invalidate TLB entries for a page in all ASIDs, after its descriptor is cleared. The operand 
+//   is VA bits 55-12; the DSB makes the descriptor write visible to table walks first.
+void tlb_flush_page(uint64_t virtual_address) {
+    __asm__ __volatile__ ("dsb ishst\n" "tlbi vaae1is, %0\n" 
+                          : : "r"((virtual_address >> 12) & 0xFFFFFFFFFFFULL) : "memory");
+}
+
+// ========================================================================
+// Unmap a range of virtual addresses. Blocks are only unmapped when the
+//   range covers the whole block. Stale TLB entries are invalidated by
+//   address for small ranges, or all at once for large ranges.
+// ========================================================================
+void arch_unmap_range(uint64_t virtual_address, uint64_t size) {
+    const uint64_t MAX_TLBI_PAGES = 32;     // Past this, flushing the whole TLB is faster
+    bool flush_all = (size / PAGE_SIZE) > MAX_TLBI_PAGES;
+
+    while (size > 0) {
+        uint64_t l0_index = ((virtual_address) >> 39) & 0x1FF;   // 0-511
+        uint64_t l1_index = ((virtual_address) >> 30) & 0x1FF;   // 0-511
+        uint64_t l2_index = ((virtual_address) >> 21) & 0x1FF;   // 0-511
+        uint64_t l3_index = ((virtual_address) >> 12) & 0x1FF;   // 0-511
+        uint64_t step     = 0;
+        uint64_t *entry   = NULL; // Entry to clear, if any
+        Page_Table *l0    = root_table(virtual_address);
+
+        if (!(l0->entries[l0_index] & VALID)) {
+            step = (1ULL << 39) - (virtual_address & ((1ULL << 39)-1));
+        } else {
+            Page_Table *l1 = (Page_Table *)(l0->entries[l0_index] & PHYS_PAGE_ADDR_MASK);
+            uint64_t *l1e = &l1->entries[l1_index];
+            if (!(*l1e & VALID) || is_block(*l1e)) {
+                step = HUGE_PAGE_SIZE - (virtual_address & (HUGE_PAGE_SIZE-1));
+                if (step == HUGE_PAGE_SIZE && size >= HUGE_PAGE_SIZE) entry = l1e;
+            } else {
+                Page_Table *l2 = (Page_Table *)(*l1e & PHYS_PAGE_ADDR_MASK);
+                uint64_t *l2e = &l2->entries[l2_index];
+                if (!(*l2e & VALID) || is_block(*l2e)) {
+                    step = LARGE_PAGE_SIZE - (virtual_address & (LARGE_PAGE_SIZE-1));
+                    if (step == LARGE_PAGE_SIZE && size >= LARGE_PAGE_SIZE) entry = l2e;
+                } else {
+                    // Clear 4KiB pages up to the end of this table or range
+                    Page_Table *l3 = (Page_Table *)(*l2e & PHYS_PAGE_ADDR_MASK);
+                    step = min(size, LARGE_PAGE_SIZE - (virtual_address & (LARGE_PAGE_SIZE-1)));
+                    for (uint64_t i = 0; i < (step + (PAGE_SIZE-1)) / PAGE_SIZE; i++) {
+                        l3->entries[l3_index + i] = 0;
+                        if (!flush_all) tlb_flush_page(virtual_address + (i * PAGE_SIZE));
+                    }
+                }
+            }
+        }
+
+        if (entry && (*entry & VALID)) {
+            *entry = 0;     // Unmap whole block
+            if (!flush_all) tlb_flush_page(virtual_address);
+        }
+
+        virtual_address += step;
+        size -= min(size, step);
+    }
+
+    if (flush_all) __asm__ __volatile__ ("dsb ishst\n" "tlbi vmalle1is\n" : : : "memory");
+    __asm__ __volatile__ ("dsb ish\n" "isb\n" : : : "memory");
+}
+
+// ==============================
+// Unmap a page/virtual address
+// ==============================
 void arch_unmap_page(UINTN virtual_address) {
-    (void)virtual_address;
+    arch_unmap_range(virtual_address, PAGE_SIZE);
+}
+
+// ==========================================================================
+// Initialize translation tables by setting up new L0 tables for TTBR0 &
+//   TTBR1
+// ==========================================================================
+void arch_init_page_tables(Page_Allocator *pa) {
+    ttbr0_table = allocate_physical_pages(pa, 1);
+    ttbr1_table = allocate_physical_pages(pa, 1);
+    if (!ttbr0_table || !ttbr1_table) arch_cpu_halt();  // Out of memory for page tables, can't continue
+
+    memset(ttbr0_table, 0, sizeof *ttbr0_table);
+    memset(ttbr1_table, 0, sizeof *ttbr1_table);
+    page_table_pages = 2;
+}
+
+// Can memory be mapped with MAP_WRITE_COMBINE? Uses the Normal Non-cacheable MAIR attribute
+bool arch_write_combine_supported(void) {
+    return true;
 }
 
-// TODO:
-void arch_init_page_tables(Memory_Map_Info *mmap) {
-    void *page_table = mmap_allocate_pages(mmap, 1);
-    memset(page_table, 0, PAGE_SIZE);  
+// Get number of translation table levels used; always 4, for 48 bit virtual addresses with 4KiB
+//   granules. The direct map & kernel fit in the 256TiB upper half, so FEAT_LPA2 isn't used.
+uint32_t arch_paging_levels(void) {
+    return 4;
 }
 
+// Get PAGING_* features enabled in arch_setup_and_call_kernel(); pages without the nG bit are
+//   always global, and MAIR_EL1 always has a Normal Non-cacheable entry for write combining.
+//   There's one address space, so ASIDs aren't used and every TLB entry has ASID 0.
+uint32_t arch_paging_features(void) {
+    return PAGING_GLOBAL_PAGES | PAGING_PAT;
+}
+
+// ==========================================================================
+// Recursive table helpers, for the kernel: the loader points an upper half
+//   L0 entry at the TTBR1 table itself, so every upper half table is 
+//   mapped at a fixed address. Each level skipped through the slot moves 
+//   the virtual address bits down 9 bits, with the slot index filling in 
+//   the top. Only upper half (TTBR1) addresses can be reached this way.
+// ==========================================================================
+uint64_t recursive_slot = 0;            // L0 entry mapping the TTBR1 tables, from Kernel_Parms
+uint64_t recursive_bases[5] = {0};      // Address of the first entry for each level, 1 = L3
+uint64_t recursive_masks[5] = {0};      // Virtual address bits that select an entry for each level
+
+// Set up kernel table helpers from what the loader set up. Call first thing in the kernel.
+void arch_init_kernel_paging(Kernel_Parms *kparms) {
+    const uint64_t address_bits = 48;
+    recursive_slot = kparms->recursive_slot;
+    for (uint64_t level = 1; level <= 4; level++) {
+        uint64_t base = ~((1ULL << address_bits) - 1);  // Upper half, translated from TTBR1
+        for (uint64_t i = 1; i <= level; i++) base |= recursive_slot << (address_bits - (9 * i));
+
+        recursive_bases[level] = base;
+        recursive_masks[level] = ((1ULL << (address_bits - (9 * level))) - 1) & ~7ULL;
+    }
+}
+
+// Get the descriptor at a level (1 = L3, 4 = L0) for an upper half address
+uint64_t *recursive_entry(uint64_t virtual_address, uint64_t level) {
+    return (uint64_t *)(recursive_bases[level] | ((virtual_address >> (9 * level)) & recursive_masks[level]));
+}
+
+// Get the lowest level descriptor mapping an address, a 4KiB page or a block, or NULL if not mapped
+uint64_t *recursive_leaf_entry(uint64_t virtual_address) {
+    for (uint64_t level = 4; level > 0; level--) {
+        uint64_t *entry = recursive_entry(virtual_address, level);
+        if (!(*entry & VALID)) return NULL;
+        if (level == 1 || is_block(*entry)) return entry;
+    }
+    return NULL;
+}
+
+// Finish changing a valid descriptor for an address: invalidate its TLB entries, and wait for it
+void recursive_flush_page(uint64_t virtual_address) {
+    tlb_flush_page(virtual_address);
+    __asm__ __volatile__ ("dsb ish\n" "isb\n" : : : "memory");
+}
+
+// ==========================================================================
+// Allocate a table for a missing descriptor at a level, and clear it 
+//   through its recursive address. Table walks may have cached entries 
+//   from the table before it was cleared, so the whole TLB is flushed.
+// ==========================================================================
+bool recursive_alloc_table(uint64_t *entry, uint64_t virtual_address, uint64_t level, Page_Allocator *pa) {
+    void *table = allocate_physical_pages(pa, 1);
+    if (!table) return false;
+    *entry = (uint64_t)table | TABLE_FLAGS;
+    __asm__ __volatile__ ("dsb ishst\n" "isb\n" : : : "memory");
+
+    uint64_t next_table = (uint64_t)recursive_entry(virtual_address, level-1) & ~(uint64_t)(PAGE_SIZE-1);
+    memset((void *)next_table, 0, PAGE_SIZE);
+    __asm__ __volatile__ ("dsb ishst\n" "tlbi vmalle1is\n" "dsb ish\n" "isb\n" : : : "memory");
+    return true;
+}
+
+// ==========================================================================
+// Map a 4KiB page with MAP_* flags. Missing tables are allocated and 
+//   cleared through their own recursive addresses. Returns false if out of
+//   memory or the address is in a block.
+// ==========================================================================
+bool recursive_map_page(uint64_t physical_address, uint64_t virtual_address, uint32_t map_flags, 
+                        Page_Allocator *pa) {
+    for (uint64_t level = 4; level > 1; level--) {
+        uint64_t *entry = recursive_entry(virtual_address, level);
+        if (is_block(*entry)) return false;
+        if (!(*entry & VALID) && !recursive_alloc_table(entry, virtual_address, level, pa)) return false;
+    }
+
+    *recursive_entry(virtual_address, 1) = (physical_address & PHYS_PAGE_ADDR_MASK) | page_flags(map_flags) | TABLE;
+    recursive_flush_page(virtual_address);
+    return true;
+}
+
+// Unmap the page mapping an address; a block is unmapped as a whole
+void recursive_unmap_page(uint64_t virtual_address) {
+    uint64_t *entry = recursive_leaf_entry(virtual_address);
+    if (!entry) return;
+
+    *entry = 0;
+    recursive_flush_page(virtual_address);
+}
+
+// Change the MAP_* flags of the page mapping an address; returns false if not mapped
+bool recursive_protect_page(uint64_t virtual_address, uint32_t map_flags) {
+    uint64_t *entry = recursive_leaf_entry(virtual_address);
+    if (!entry) return false;
+
+    *entry = (*entry & (PHYS_PAGE_ADDR_MASK | TABLE)) | page_flags(map_flags);
+    recursive_flush_page(virtual_address);
+    return true;
+}
+
+// Can the kernel fill in the direct map on page faults, for PAGING_LAZY_DIRECT_MAP? There's no
+//   data abort handler, so the loader always maps all memory.
+bool arch_lazy_mapping_supported(void) {
+    return false;
+}
+
+// Never called, as arch_lazy_mapping_supported() is false and the loader doesn't set 
+//   PAGING_LAZY_DIRECT_MAP
+void arch_init_lazy_mapping(Kernel_Parms *kparms) {
+    (void)kparms;
+}
@@ -102,8 +102,33 @@ enum {
     PRESENT    = (1 << 0),
     READWRITE  = (1 << 1),
     USER       = (1 << 2),
+    PWT        = (1 << 3),  // Page Write Through; PAT index bit 0
+    PCD        = (1 << 4),  // Page Cache Disable; PAT index bit 1
+    LARGE_PAGE = (1 << 7),  // PD/PDPT entry maps a 2MiB/1GiB page instead of a page table
+    GLOBAL     = (1 << 8),  // Last level entry only; not flushed from the TLB on CR3 writes, needs CR4.PGE
 };
 
+#define HUGE_PAGE_SIZE 0x40000000   // 1GiB page, mapped from a page directory pointer table entry
+
+#define NO_EXECUTE (1ULL << 63) // Page flag bit 63, needs EFER.NXE
+
+#define IA32_EFER 0xC0000080    // Extended Feature Enable Register MSR
+#define EFER_NXE  (1 << 11)     // No-Execute Enable
+#define CR0_WP    (1 << 16)     // Write Protect; supervisor writes to read-only pages fault
+#define CR4_PGE   (1 << 7)      // Page Global Enable
+#define CR4_PCIDE (1 << 17)     // Process Context ID Enable; CR3 bits 11-0 are the current PCID
+#define CR4_LA57  (1 << 12)     // 57 bit linear addresses, 5 level paging; only set with paging disabled
+
+#define CR3_PCID_MASK 0xFFF         // Current PCID in CR3 when CR4.PCIDE is set
+#define CR3_NO_FLUSH  (1ULL << 63)  // Keep TLB entries for the new PCID when writing CR3
+#define MAX_PCIDS     4096          // 12 bit process context IDs
+
+// Page Attribute Table MSR: 8 memory types, selected per page by the PAT/PCD/PWT bits. Same as 
+//   the power on default (WB, WT, UC-, UC, repeated), except entry 1 is Write Combining instead 
+//   of Write Through, selected with only PWT so it works the same in 4KiB & large pages
+#define IA32_PAT  0x277
+#define PAT_VALUE 0x0007040600070106ULL
+
 #define ARCH_COFF_MACHINE 0x8664    // Machine type bytes for PE Coff Header
 
 #define PHYS_PAGE_ADDR_MASK 0x000FFFFFFFFFF000  // 52 bit physical address limit, lowest 12 bits are for flags only
@@ -111,12 +136,21 @@ enum {
 // ---------------------
 // Global variables
 // ---------------------
-Page_Table *pml4 = NULL;        // Top level 4 page table for x86_64 long mode paging
+Page_Table *pml4 = NULL;        // Top level page table for 4 level paging
+Page_Table *pml5 = NULL;        // Top level page table for 5 level paging, if used
+uint8_t paging_levels = 4;      // Page table levels: 4, or 5 with LA57
+bool nx_supported = false;      // CPU supports no-execute page bit
+bool huge_pages_supported = false;  // CPU supports 1GiB pages
+bool pat_supported = false;     // CPU supports Page Attribute Table, for write combining
+bool pge_supported = false;     // CPU supports global pages
+bool pcid_supported = false;    // CPU supports process context IDs
+bool invpcid_supported = false; // CPU supports the INVPCID instruction
+bool la57_supported = false;    // CPU supports 5 level paging
+UINTN page_table_pages = 0;     // Pages allocated for page tables
 
 // ---------------------
 // Functions
 // ---------------------
-extern void *mmap_allocate_pages(Memory_Map_Info *mmap, uint64_t pages);
 extern void *memset(void *dst, uint8_t c, uint64_t len);
 
 // Clear interrupts and halt CPU
@@ -124,6 +158,138 @@ void arch_cpu_halt(void) {
     __asm__ ("cli; hlt");
 }
 
+// =====================================================================
+// Update a running CRC32C value with the SSE4.2 crc32 instruction, 8 
+//   bytes at a time; fall back to the lookup table without SSE4.2
+// =====================================================================
+uint32_t arch_crc32c(uint32_t crc, void *buffer, uint64_t len) {
+    static int has_sse42 = -1;
+    if (has_sse42 < 0) {
+        uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
+        __asm__ __volatile__ ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        has_sse42 = (ecx >> 20) & 1;    // CPUID.01H:ECX.SSE4_2[bit 20]
+    }
+    if (!has_sse42) return crc32c_update(crc, buffer, len);
+
+    uint8_t *p = buffer;
+    uint64_t crc64 = crc;
+    for (; len > 0 && ((uint64_t)p & 7); len--, p++)
+        __asm__ ("crc32b %1, %k0" : "+r"(crc64) : "rm"(*p));
+
+    for (; len >= 8; len -= 8, p += 8)
+        __asm__ ("crc32q %1, %0" : "+r"(crc64) : "rm"(*(uint64_t *)p));
+
+    for (; len > 0; len--, p++)
+        __asm__ ("crc32b %1, %k0" : "+r"(crc64) : "rm"(*p));
+
+    return (uint32_t)crc64;
+}
+
+// Read Time Stamp Counter, for measuring elapsed ticks
+uint64_t arch_read_timestamp(void) {
+    uint32_t low = 0, high = 0;
+    __asm__ __volatile__ ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// ==========================================================================
+// Expand a bitmap font glyph to ARGB pixels in fg/bg colors, 8 pixels of a
+//   line at a time: broadcast the 8 pixels' bits to every lane, AND & 
+//   compare with each lane's bit to get a lane mask, then blend fg & bg 
+//   with it. AVX2 does the 8 pixels per instruction, SSE2 4. Pixels left 
+//   over in fonts that aren't a multiple of 8 wide are done one at a time.
+// ==========================================================================
+typedef uint32_t Pixels_4 __attribute__((vector_size(16), aligned(4), may_alias));
+typedef uint32_t Pixels_8 __attribute__((vector_size(32), aligned(4), may_alias));
+
+__attribute__((target("avx2")))
+void expand_glyph_avx2(uint32_t *dst, uint32_t pitch, Bitmap_Font *font, uint8_t *glyph, 
+                       uint32_t fg, uint32_t bg) {
+    const Pixels_8 lanes = {0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1};
+    const Pixels_8 bg8   = (Pixels_8){0} + bg;
+    const Pixels_8 diff8 = (Pixels_8){0} + (fg ^ bg);
+    const uint32_t line_bytes = (font->width + 7) / 8;
+
+    for (uint32_t i = 0; i < font->height; i++, dst += pitch, glyph += line_bytes) {
+        uint64_t bits = glyph_line_bits(font, glyph);
+        uint32_t px = 0;
+        for (; px + 8 <= font->width; px += 8) {
+            Pixels_8 group = (Pixels_8){0} + (uint32_t)(bits >> (font->width - 8 - px));
+            Pixels_8 mask  = (Pixels_8)((group & lanes) == lanes);
+            *(Pixels_8 *)&dst[px] = bg8 ^ (diff8 & mask);
+        }
+        for (; px < font->width; px++)
+            dst[px] = bg ^ ((fg ^ bg) & -(uint32_t)((bits >> (font->width-1 - px)) & 1));
+    }
+}
+
+void expand_glyph_sse2(uint32_t *dst, uint32_t pitch, Bitmap_Font *font, uint8_t *glyph, 
+                       uint32_t fg, uint32_t bg) {
+    const Pixels_4 lanes_lo = {0x80, 0x40, 0x20, 0x10}, lanes_hi = {8, 4, 2, 1};
+    const Pixels_4 bg4   = (Pixels_4){0} + bg;
+    const Pixels_4 diff4 = (Pixels_4){0} + (fg ^ bg);
+    const uint32_t line_bytes = (font->width + 7) / 8;
+
+    for (uint32_t i = 0; i < font->height; i++, dst += pitch, glyph += line_bytes) {
+        uint64_t bits = glyph_line_bits(font, glyph);
+        uint32_t px = 0;
+        for (; px + 8 <= font->width; px += 8) {
+            Pixels_4 group = (Pixels_4){0} + (uint32_t)(bits >> (font->width - 8 - px));
+            *(Pixels_4 *)&dst[px]   = bg4 ^ (diff4 & (Pixels_4)((group & lanes_lo) == lanes_lo));
+            *(Pixels_4 *)&dst[px+4] = bg4 ^ (diff4 & (Pixels_4)((group & lanes_hi) == lanes_hi));
+        }
+        for (; px < font->width; px++)
+            dst[px] = bg ^ ((fg ^ bg) & -(uint32_t)((bits >> (font->width-1 - px)) & 1));
+    }
+}
+
+// Expand a glyph with AVX2 if the CPU supports it and XCR0 has AVX state enabled, else SSE2
+void arch_expand_glyph(uint32_t *dst, uint32_t pitch, Bitmap_Font *font, uint8_t *glyph, 
+                       uint32_t fg, uint32_t bg) {
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        // CPUID.01H:ECX.OSXSAVE[bit 27] & AVX[bit 28], XCR0 SSE & AVX state[bits 2:1], and
+        //   CPUID.(EAX=07H,ECX=0):EBX.AVX2[bit 5]
+        uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
+        __asm__ __volatile__ ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        has_avx2 = 0;
+        if (((ecx >> 27) & 1) && ((ecx >> 28) & 1)) {
+            uint32_t xcr0 = 0;
+            __asm__ __volatile__ ("xgetbv" : "=a"(xcr0), "=d"(edx) : "c"(0));
+            eax = 7, ecx = 0;
+            __asm__ __volatile__ ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+            has_avx2 = ((xcr0 & 6) == 6) && ((ebx >> 5) & 1);
+        }
+    }
+
+    if (has_avx2) expand_glyph_avx2(dst, pitch, font, glyph, fg, bg);
+    else          expand_glyph_sse2(dst, pitch, font, glyph, fg, bg);
+}
+
+// ==========================================================================
+// Copy pixels to the framebuffer with 16 byte non-temporal stores, 64 bytes 
+//   at a time where possible, so write combining buffers are written whole
+//   and video memory is never read. Unaligned head & tail pixels are copied
+//   one at a time.
+// ==========================================================================
+void arch_copy_to_framebuffer(uint32_t *dst, uint32_t *src, uint64_t pixels) {
+    for (; pixels > 0 && ((uint64_t)dst & 15); pixels--) *dst++ = *src++;
+
+    for (; pixels >= 16; pixels -= 16, dst += 16, src += 16)
+        __asm__ __volatile__ ("movdqu   (%1), %%xmm0\n" "movdqu 16(%1), %%xmm1\n"
+                              "movdqu 32(%1), %%xmm2\n" "movdqu 48(%1), %%xmm3\n"
+                              "movntdq %%xmm0,   (%0)\n" "movntdq %%xmm1, 16(%0)\n"
+                              "movntdq %%xmm2, 32(%0)\n" "movntdq %%xmm3, 48(%0)\n"
+                              : : "r"(dst), "r"(src) : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+
+    for (; pixels >= 4; pixels -= 4, dst += 4, src += 4)
+        __asm__ __volatile__ ("movdqu (%1), %%xmm0\n" "movntdq %%xmm0, (%0)\n" 
+                              : : "r"(dst), "r"(src) : "xmm0", "memory");
+
+    for (; pixels > 0; pixels--) *dst++ = *src++;
+    __asm__ __volatile__ ("sfence" : : : "memory");    // Order non-temporal stores before later writes
+}
+
 // ===================================
 // Return example Task State Segment
 // ===================================
@@ -165,22 +331,164 @@ GDT example_gdt(TSS tss, uint64_t tss_address) {
     };
 }
 
+// Values used by arch_setup_and_call_kernel() after the 5 level paging switch. They're read
+//   through RBX, as the upper 32 bits of registers are undefined after running 32 bit code and 
+//   RBX only needs its lower 32 bits.
+typedef struct {
+    uint64_t root_table;    // CR3 value, PML4 or PML5
+    uint64_t stack;         // Top of new stack
+    uint64_t entry;
+    uint64_t kparms;
+    uint64_t cr4_flags;
+    Descriptor_Register gdtr;
+    Descriptor_Register gdtr_identity;  // GDT at its identity mapped address
+    uint64_t switch_stack;              // Identity mapped stack for the 5 level paging switch
+} Kernel_Call;
+
+// GDT, TSS & Kernel_Call for arch_setup_and_call_kernel(), in a page of loader memory from 
+//   arch_init_page_tables(), so they're direct mapped with the rest of it for the kernel. For a 
+//   5 level paging switch the page is also identity mapped, and the end of it is the stack.
+typedef struct {
+    GDT gdt;
+    TSS tss;
+    Kernel_Call call;
+} Handoff;
+
+Handoff *handoff = NULL;
+
 // ============================================================================
-// Set page tables & paging, do other arch specific settings, and call kernel
+// Set page tables & paging, do other arch specific settings, and call kernel.
+//   Stack, kernel parms, GDT & TSS are used through the direct map; only this
+//   function's code needs to be identity mapped, as it keeps running from its
+//   physical address after loading the new page tables.
 // ============================================================================
 void arch_setup_and_call_kernel(Entry_Point entry, void *kernel_stack, uint32_t stack_size, 
                                 Kernel_Parms *kparms) {
-    TSS tss = example_tss();
-    uint64_t tss_address = (UINTN)&tss;
-    GDT gdt = example_gdt(tss, tss_address);
-    Descriptor_Register gdtr = {.limit = sizeof gdt - 1, .base = (uint64_t)&gdt}; 
+    const uint64_t direct_map_base = kparms->direct_map_base;
+    handoff->tss = example_tss();
+    handoff->gdt = example_gdt(handoff->tss, direct_map_base + (uint64_t)&handoff->tss);
+    Descriptor_Register gdtr = {.limit = sizeof handoff->gdt - 1, 
+                                .base  = direct_map_base + (uint64_t)&handoff->gdt}; 
+
+    // Enable no-execute bit in page tables for non-executable kernel segments
+    if (nx_supported) {
+        uint32_t low = 0, high = 0;
+        __asm__ __volatile__ ("rdmsr" : "=a"(low), "=d"(high) : "c"(IA32_EFER));
+        __asm__ __volatile__ ("wrmsr" : : "a"(low | EFER_NXE), "d"(high), "c"(IA32_EFER));
+    }
+
+    // Set PAT with write combining entry; flush caches first as memory types change
+    if (pat_supported) {
+        __asm__ __volatile__ ("wbinvd" : : : "memory");
+        __asm__ __volatile__ ("wrmsr" : : "a"((uint32_t)PAT_VALUE), "d"((uint32_t)(PAT_VALUE >> 32)), 
+                                          "c"(IA32_PAT));
+    }
+
+    // Global pages, and process context IDs if supported, are enabled after loading the new page 
+    //   tables. PCIDE can only be set when CR3 has PCID 0, which the page aligned PML4 address does.
+    uint64_t cr4_flags = 0;
+    if (pge_supported)  cr4_flags |= CR4_PGE;
+    if (pcid_supported) cr4_flags |= CR4_PCIDE;
 
-    // Set new page tables (CR3 = PML4) and GDT (lgdt && ltr), and call entry point with parms
+    // Switch to 5 level paging if firmware didn't already enable it. LA57 can only be changed with
+    //   paging off, which means leaving long mode through 32 bit code; this function, the PML5 and
+    //   the handoff page are all below 4GiB, and the handoff page is identity mapped in the new 
+    //   page tables, all done in arch_init_page_tables().
+    uint64_t cr4 = 0;
+    __asm__ __volatile__ ("movq %%CR4, %0\n" : "=r"(cr4));
+    uint32_t la57_switch = paging_levels == 5 && !(cr4 & CR4_LA57);
+
+    handoff->call = (Kernel_Call){
+        .root_table    = (uint64_t)((paging_levels == 5) ? pml5 : pml4),
+        .stack         = direct_map_base + (uint64_t)kernel_stack + stack_size,
+        .entry         = (uint64_t)entry,
+        .kparms        = direct_map_base + (uint64_t)kparms,
+        .cr4_flags     = cr4_flags,
+        .gdtr          = gdtr,
+        .gdtr_identity = {.limit = sizeof handoff->gdt - 1, .base = (uint64_t)&handoff->gdt},
+        .switch_stack  = (uint64_t)handoff + PAGE_SIZE,
+    };
+
+    Kernel_Call *call_address = &handoff->call;
+
+    // Set new GDT (lgdt && ltr), stack & page tables (CR3 = PML4/PML5), and call entry point with 
+    //   parms. Everything needed from the old stack is loaded into registers before the CR3 write,
+    //   as the new page tables don't identity map it.
     __asm__ __volatile__(
         "cli\n"                     // Clear interrupts before setting new GDT/TSS, etc.
-        "movq %[pml4], %%CR3\n"     // Load new page tables
-        "lgdt %[gdt]\n"             // Load new GDT from gdtr register
-        "ltr %[tss]\n"              // Load new task register with new TSS value (byte offset into GDT)
+
+        "testl %[la57_switch], %[la57_switch]\n"
+        "jz 2f\n"
+
+        // Far return to the 32 bit code segment (compatibility mode), using the GDT & stack in the
+        //   identity mapped handoff page until the direct map is in use
+        "movq %c[switch_stack](%%RBX), %%RSP\n"
+        "lgdt %c[gdtr_identity](%%RBX)\n"
+        "movq %c[root_table](%%RBX), %%RDX\n"
+        "leaq 3f(%%RIP), %%RSI\n"   // 64 bit code to return to after
+        "pushq $0x28\n"
+        "leaq 4f(%%RIP), %%RAX\n"
+        "pushq %%RAX\n"
+        "lretq\n"
+
+        ".code32\n"
+        "4:\n"
+        "movl $0x30, %%EAX\n"       // 32 bit kernel data segment, segment limits apply again
+        "movl %%EAX, %%DS\n"
+        "movl %%EAX, %%SS\n"
+
+        // Turn off paging to leave long mode, set LA57, and turn paging back on with the PML5
+        "movl %%CR0, %%EAX\n"
+        "andl $0x7FFFFFFF, %%EAX\n"
+        "movl %%EAX, %%CR0\n"
+        "movl %%CR4, %%EAX\n"
+        "orl %[cr4_la57], %%EAX\n"
+        "movl %%EAX, %%CR4\n"
+        "movl %%EDX, %%CR3\n"
+        "movl %%CR0, %%EAX\n"
+        "orl $0x80000000, %%EAX\n"
+        "movl %%EAX, %%CR0\n"
+
+        // Far return to the 64 bit code segment
+        "pushl $0x8\n"
+        "pushl %%ESI\n"
+        "lretl\n"
+        ".code64\n"
+
+        "3:\n"
+        "movl %%EBX, %%EBX\n"       // Zero extend back to 64 bits
+        "movl %%ESP, %%ESP\n"
+
+        "2:\n"
+        "lgdt %c[gdtr](%%RBX)\n"    // Load new GDT from gdtr register; not used until ltr below
+
+        // Page tables, CR4 flags, new stack, parms for the entry point & entry point
+        "movq %c[root_table](%%RBX), %%RDX\n"
+        "movq %c[cr4_flags](%%RBX), %%RSI\n"
+        "movq %c[stack](%%RBX), %%RDI\n"
+        "movq %c[kparms](%%RBX), %%RCX\n"
+        "movq %c[entry](%%RBX), %%RBX\n"
+
+        // Clear CR4.PGE first to flush any global firmware TLB entries, which would survive the CR3
+        //   write and could still translate addresses the new page tables do not map
+        "movq %%CR4, %%RAX\n"
+        "andq %[not_pge], %%RAX\n"
+        "movq %%RAX, %%CR4\n"
+
+        "movq %%RDX, %%CR3\n"       // Load new page tables
+
+        "orq %%RSI, %%RAX\n"
+        "movq %%RAX, %%CR4\n"
+
+        "movq %%RDI, %%RSP\n"       // Set new stack value to use (for SP/stack pointer, etc.)
+
+        // Enforce read-only kernel pages for supervisor writes too
+        "movq %%CR0, %%RAX\n"
+        "orq %[cr0_wp], %%RAX\n"
+        "movq %%RAX, %%CR0\n"
+
+        "movw %[tss], %%AX\n"
+        "ltr %%AX\n"                // Load new task register with new TSS value (byte offset into GDT)
 
         // Jump to new code segment in GDT (offset in GDT of 64 bit kernel/system code segment)
         "pushq $0x8\n"
@@ -197,85 +505,623 @@ void arch_setup_and_call_kernel(Entry_Point entry, void *kernel_stack, uint32_t
         "movq %%RAX, %%GS\n"    // Extra segment (3), these also have different uses in Long Mode
         "movq %%RAX, %%SS\n"    // Stack segment
 
-        // Set new stack value to use (for SP/stack pointer, etc.)
-        "movq %[stack], %%RSP\n"
-
         // Call new entry point in higher memory
-        "callq *%[entry]\n" // First parameter is kparms in RCX in input constraints below, for MS ABI
-      :
-      : [pml4]"r"(pml4), [gdt]"m"(gdtr), [tss]"r"((uint16_t)offsetof(GDT, tss)),
-        [stack]"gm"((uint64_t)kernel_stack + stack_size),    // Top of newly allocated stack
-        [entry]"r"(entry), "c"(kparms)
-      : "rax", "memory");
+        "callq *%%RBX\n"   // First parameter is kparms in RCX, for MS ABI
+      : "+b"(call_address)
+      : [la57_switch]"r"(la57_switch), [tss]"i"((uint16_t)offsetof(GDT, tss)),
+        [root_table]"i"(offsetof(Kernel_Call, root_table)), [stack]"i"(offsetof(Kernel_Call, stack)),
+        [entry]"i"(offsetof(Kernel_Call, entry)), [kparms]"i"(offsetof(Kernel_Call, kparms)),
+        [cr4_flags]"i"(offsetof(Kernel_Call, cr4_flags)), [gdtr]"i"(offsetof(Kernel_Call, gdtr)),
+        [gdtr_identity]"i"(offsetof(Kernel_Call, gdtr_identity)),
+        [switch_stack]"i"(offsetof(Kernel_Call, switch_stack)),
+        [cr0_wp]"i"(CR0_WP), [not_pge]"i"(~CR4_PGE), [cr4_la57]"i"(CR4_LA57)
+      : "rax", "rcx", "rdx", "rsi", "rdi", "memory");
+}
+
+// ======================================================================
+// Get the next level page table from a page table entry, allocating it 
+//   if not present. Permissions are only restricted at the last level.
+// ======================================================================
+Page_Table *next_page_table(Page_Table *table, uint64_t index, Page_Allocator *pa) {
+    if (!(table->entries[index] & PRESENT)) {
+        void *address = allocate_physical_pages(pa, 1);
+        if (!address) arch_cpu_halt();  // Out of memory for page tables, can't continue
+
+        memset(address, 0, sizeof(Page_Table));
+        table->entries[index] = (uint64_t)address | PRESENT | READWRITE | USER;  
+        page_table_pages++;
+    }
+
+    return (Page_Table *)(table->entries[index] & PHYS_PAGE_ADDR_MASK);
+}
+
+// ======================================================================
+// Get the PML4 for a virtual address; with 5 level paging it's in the
+//   PML5. Returns NULL if not present, or allocates it if pa is given.
+// ======================================================================
+Page_Table *pml4_table(uint64_t virtual_address, Page_Allocator *pa) {
+    if (paging_levels < 5) return pml4;
+
+    uint64_t pml5_index = (virtual_address >> 48) & 0x1FF;   // 0-511
+    if (pa) return next_page_table(pml5, pml5_index, pa);
+    if (!(pml5->entries[pml5_index] & PRESENT)) return NULL;
+    return (Page_Table *)(pml5->entries[pml5_index] & PHYS_PAGE_ADDR_MASK);
+}
+
+// Get page table entry flags for MAP_* flags
+uint64_t page_flags(uint32_t map_flags) {
+    uint64_t flags = PRESENT;
+    if (map_flags & MAP_WRITE) flags |= READWRITE;
+    if (map_flags & MAP_USER)  flags |= USER;
+    if (!(map_flags & MAP_EXECUTE) && nx_supported) flags |= NO_EXECUTE;
+    if ((map_flags & MAP_WRITE_COMBINE) && pat_supported) flags |= PWT;   // PAT entry 1
+    if (map_flags & MAP_DEVICE) flags |= PCD | PWT;                         // PAT entry 3, UC
+    if ((map_flags & MAP_GLOBAL) && pge_supported) flags |= GLOBAL;
+    return flags;
+}
+
+// ========================================================================
+// Map a range of memory with MAP_* flags. Walks the page tables once per
+//   2MiB of virtual addresses, and fills 4KiB page table entries for that
+//   2MiB in one loop. 1GiB and 2MiB pages are used wherever physical & 
+//   virtual addresses are aligned for them and the range covers the whole
+//   page. Parts already mapped are skipped.
+// ========================================================================
+void arch_map_range(uint64_t physical_address, uint64_t virtual_address, uint64_t size, 
+                    uint32_t map_flags, Page_Allocator *pa) {
+    const uint64_t flags = page_flags(map_flags);
+
+    while (size > 0) {
+        uint64_t pml4_index = ((virtual_address) >> 39) & 0x1FF;   // 0-511
+        uint64_t pdpt_index = ((virtual_address) >> 30) & 0x1FF;   // 0-511
+        uint64_t pdt_index  = ((virtual_address) >> 21) & 0x1FF;   // 0-511
+        uint64_t pt_index   = ((virtual_address) >> 12) & 0x1FF;   // 0-511
+        uint64_t alignment  = physical_address | virtual_address;
+        uint64_t step       = 0;    // Bytes mapped or skipped this time through
+
+        Page_Table *pdpt = next_page_table(pml4_table(virtual_address, pa), pml4_index, pa);
+        if (huge_pages_supported && size >= HUGE_PAGE_SIZE && !(alignment & (HUGE_PAGE_SIZE-1)) &&
+            !(pdpt->entries[pdpt_index] & PRESENT)) {
+            // Map a 1GiB page
+            pdpt->entries[pdpt_index] = (physical_address & PHYS_PAGE_ADDR_MASK) | flags | LARGE_PAGE;
+            step = HUGE_PAGE_SIZE;
+
+        } else if (pdpt->entries[pdpt_index] & LARGE_PAGE) {
+            step = HUGE_PAGE_SIZE - (virtual_address & (HUGE_PAGE_SIZE-1)); // Already mapped
+
+        } else {
+            Page_Table *pdt = next_page_table(pdpt, pdpt_index, pa);
+            if (size >= LARGE_PAGE_SIZE && !(alignment & (LARGE_PAGE_SIZE-1)) &&
+                !(pdt->entries[pdt_index] & PRESENT)) {
+                // Map a 2MiB page
+                pdt->entries[pdt_index] = (physical_address & PHYS_PAGE_ADDR_MASK) | flags | LARGE_PAGE;
+                step = LARGE_PAGE_SIZE;
+
+            } else if (pdt->entries[pdt_index] & LARGE_PAGE) {
+                step = LARGE_PAGE_SIZE - (virtual_address & (LARGE_PAGE_SIZE-1));  // Already mapped
+
+            } else {
+                // Fill 4KiB pages up to the end of this page table or range
+                Page_Table *pt = next_page_table(pdt, pdt_index, pa);
+                step = min(size, LARGE_PAGE_SIZE - (virtual_address & (LARGE_PAGE_SIZE-1)));
+
+                uint64_t entry = (physical_address & PHYS_PAGE_ADDR_MASK) | flags;
+                for (uint64_t *pte = &pt->entries[pt_index]; 
+                     pte < &pt->entries[pt_index] + ((step + (PAGE_SIZE-1)) / PAGE_SIZE); 
+                     pte++, entry += PAGE_SIZE) {
+                    if (!(*pte & PRESENT)) *pte = entry;
+                }
+            }
+        }
+
+        physical_address += step;
+        virtual_address  += step;
+        size -= min(size, step);
+    }
 }
 
 // ==================================================================
 // Map a virtual address to a physical address for a page of memory
 // ==================================================================
-void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Memory_Map_Info *mmap) {
-    int flags = PRESENT | READWRITE | USER;   // 0b111
+void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Page_Allocator *pa) {
+    arch_map_range(physical_address, virtual_address, PAGE_SIZE, MAP_WRITE | MAP_EXECUTE | MAP_USER, pa);
+}
 
-    uint64_t pml4_index = ((virtual_address) >> 39) & 0x1FF;   // 0-511
-    uint64_t pdpt_index = ((virtual_address) >> 30) & 0x1FF;   // 0-511
-    uint64_t pdt_index  = ((virtual_address) >> 21) & 0x1FF;   // 0-511
-    uint64_t pt_index   = ((virtual_address) >> 12) & 0x1FF;   // 0-511
+// ========================================================================
+// Allocate the top level page tables for a range, PDPTs (and PML4s with 
+//   5 level paging), without mapping anything. The top level entries are
+//   then fixed, and lower tables can be allocated on page faults later.
+// ========================================================================
+void arch_reserve_range(uint64_t virtual_address, uint64_t size, Page_Allocator *pa) {
+    const uint64_t PML4_ENTRY_SIZE = 1ULL << 39;    // 512GiB
+    const uint64_t end = virtual_address + size;
 
-    // Make sure pdpt exists, if not then allocate it
-    if (!(pml4->entries[pml4_index] & PRESENT)) {
-        void *pdpt_address = mmap_allocate_pages(mmap, 1);
+    for (uint64_t address = virtual_address & ~(PML4_ENTRY_SIZE-1); address < end; address += PML4_ENTRY_SIZE)
+        next_page_table(pml4_table(address, pa), (address >> 39) & 0x1FF, pa);
+}
 
-        memset(pdpt_address, 0, sizeof(Page_Table));
-        pml4->entries[pml4_index] = (uint64_t)pdpt_address | flags;  
-    }
+// ==========================================================================
+// Point a top level page table entry at the top level table itself, for 
+//   the kernel's recursive page table helpers. Not user accessible or 
+//   global, as page tables belong to one address space.
+// ==========================================================================
+void arch_set_recursive_slot(uint64_t slot) {
+    Page_Table *root_table = (paging_levels == 5) ? pml5 : pml4;
+    root_table->entries[slot & 0x1FF] = (uint64_t)root_table | PRESENT | READWRITE | 
+                                        (nx_supported ? NO_EXECUTE : 0);
+}
 
-    // Make sure pdt exists, if not then allocate it
-    Page_Table *pdpt = (Page_Table *)(pml4->entries[pml4_index] & PHYS_PAGE_ADDR_MASK);
-    if (!(pdpt->entries[pdpt_index] & PRESENT)) {
-        void *pdt_address = mmap_allocate_pages(mmap, 1);
+// Get number of pages allocated for page tables
+UINTN arch_page_table_pages(void) {
+    return page_table_pages;
+}
 
-        memset(pdt_address, 0, sizeof(Page_Table));
-        pdpt->entries[pdpt_index] = (uint64_t)pdt_address | flags;  
-    }
+// ========================================================================
+// Unmap a range of virtual addresses. Large pages are only unmapped when 
+//   the range covers the whole page. Stale TLB entries are flushed with
+//   invlpg for small ranges, or all at once for large ranges.
+// ========================================================================
+void arch_unmap_range(uint64_t virtual_address, uint64_t size) {
+    const uint64_t MAX_INVLPG_PAGES = 32;   // Past this, flushing the whole TLB is faster
+    bool flush_all = (size / PAGE_SIZE) > MAX_INVLPG_PAGES;
+
+    while (size > 0) {
+        uint64_t pml4_index = ((virtual_address) >> 39) & 0x1FF;   // 0-511
+        uint64_t pdpt_index = ((virtual_address) >> 30) & 0x1FF;   // 0-511
+        uint64_t pdt_index  = ((virtual_address) >> 21) & 0x1FF;   // 0-511
+        uint64_t pt_index   = ((virtual_address) >> 12) & 0x1FF;   // 0-511
+        uint64_t step       = 0;
+        uint64_t *entry     = NULL; // Entry to clear, if any
+        Page_Table *level4_table = pml4_table(virtual_address, NULL);
 
-    // Make sure pt exists, if not then allocate it
-    Page_Table *pdt = (Page_Table *)(pdpt->entries[pdpt_index] & PHYS_PAGE_ADDR_MASK);
-    if (!(pdt->entries[pdt_index] & PRESENT)) {
-        void *pt_address = mmap_allocate_pages(mmap, 1);
+        if (!level4_table) {
+            step = (1ULL << 48) - (virtual_address & ((1ULL << 48)-1));
+        } else if (!(level4_table->entries[pml4_index] & PRESENT)) {
+            step = (1ULL << 39) - (virtual_address & ((1ULL << 39)-1));
+        } else {
+            Page_Table *pdpt = (Page_Table *)(level4_table->entries[pml4_index] & PHYS_PAGE_ADDR_MASK);
+            uint64_t *pdpte = &pdpt->entries[pdpt_index];
+            if (!(*pdpte & PRESENT) || (*pdpte & LARGE_PAGE)) {
+                step = HUGE_PAGE_SIZE - (virtual_address & (HUGE_PAGE_SIZE-1));
+                if (step == HUGE_PAGE_SIZE && size >= HUGE_PAGE_SIZE) entry = pdpte;
+            } else {
+                Page_Table *pdt = (Page_Table *)(*pdpte & PHYS_PAGE_ADDR_MASK);
+                uint64_t *pdte = &pdt->entries[pdt_index];
+                if (!(*pdte & PRESENT) || (*pdte & LARGE_PAGE)) {
+                    step = LARGE_PAGE_SIZE - (virtual_address & (LARGE_PAGE_SIZE-1));
+                    if (step == LARGE_PAGE_SIZE && size >= LARGE_PAGE_SIZE) entry = pdte;
+                } else {
+                    // Clear 4KiB pages up to the end of this page table or range
+                    Page_Table *pt = (Page_Table *)(*pdte & PHYS_PAGE_ADDR_MASK);
+                    step = min(size, LARGE_PAGE_SIZE - (virtual_address & (LARGE_PAGE_SIZE-1)));
+                    for (uint64_t i = 0; i < (step + (PAGE_SIZE-1)) / PAGE_SIZE; i++) {
+                        pt->entries[pt_index + i] = 0;
+                        if (!flush_all) 
+                            __asm__ __volatile__ ("invlpg (%0)\n" : : "r"(virtual_address + (i * PAGE_SIZE)) : "memory");
+                    }
+                }
+            }
+        }
+
+        if (entry && (*entry & PRESENT)) {
+            *entry = 0;     // Unmap whole large page
+            if (!flush_all) __asm__ __volatile__ ("invlpg (%0)\n" : : "r"(virtual_address) : "memory");
+        }
 
-        memset(pt_address, 0, sizeof(Page_Table));
-        pdt->entries[pdt_index] = (uint64_t)pt_address | flags;  
+        virtual_address += step;
+        size -= min(size, step);
     }
 
-    // Map new page physical address if not present
-    Page_Table *pt = (Page_Table *)(pdt->entries[pdt_index] & PHYS_PAGE_ADDR_MASK);
-    if (!(pt->entries[pt_index] & PRESENT)) 
-        pt->entries[pt_index] = (physical_address & PHYS_PAGE_ADDR_MASK) | flags;
+    // Flush the TLB for all pages at once. Reloading CR3 keeps global pages, so toggle CR4.PGE 
+    //   instead when it's set, which flushes everything.
+    if (flush_all) {
+        uint64_t cr4 = 0;
+        __asm__ __volatile__ ("movq %%CR4, %0\n" : "=r"(cr4));
+        if (cr4 & CR4_PGE) {
+            __asm__ __volatile__ ("movq %0, %%CR4\n" "movq %1, %%CR4\n" 
+                                  : : "r"(cr4 & ~CR4_PGE), "r"(cr4) : "memory");
+        } else {
+            uint64_t cr3 = 0;
+            __asm__ __volatile__ ("movq %%CR3, %0\n" "movq %0, %%CR3\n" : "=r"(cr3) : : "memory");
+        }
+    }
 }
 
 // ==============================
 // Unmap a page/virtual address 
 // ==============================
 void arch_unmap_page(UINTN virtual_address) {
-    uint64_t pml4_index = ((virtual_address) >> 39) & 0x1FF;   // 0-511
-    uint64_t pdpt_index = ((virtual_address) >> 30) & 0x1FF;   // 0-511
-    uint64_t pdt_index  = ((virtual_address) >> 21) & 0x1FF;   // 0-511
-    uint64_t pt_index   = ((virtual_address) >> 12) & 0x1FF;   // 0-511
+    arch_unmap_range(virtual_address, PAGE_SIZE);
+}
 
-    Page_Table *pdpt = (Page_Table *)(pml4->entries[pml4_index] & PHYS_PAGE_ADDR_MASK);
-    Page_Table *pdt = (Page_Table *)(pdpt->entries[pdpt_index] & PHYS_PAGE_ADDR_MASK);
-    Page_Table *pt = (Page_Table *)(pdt->entries[pdt_index] & PHYS_PAGE_ADDR_MASK);
+// ==========================================================================
+// Initialize page tables by setting up a new top level page table; a PML5
+//   if 5 level paging is supported and can be switched to, else a PML4
+// ==========================================================================
+void arch_init_page_tables(Page_Allocator *pa) {
+    // Check for no-execute page bit support, CPUID.80000001H:EDX.NX[bit 20], 
+    //   and 1GiB page support, CPUID.80000001H:EDX.Page1GB[bit 26]
+    uint32_t eax = 0x80000000, ebx = 0, ecx = 0, edx = 0;
+    __asm__ __volatile__ ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (eax >= 0x80000001) {
+        eax = 0x80000001, ecx = 0;
+        __asm__ __volatile__ ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        nx_supported         = (edx >> 20) & 1;
+        huge_pages_supported = (edx >> 26) & 1;
+    }
+
+    // Check for PAT support, CPUID.01H:EDX.PAT[bit 16], global pages, CPUID.01H:EDX.PGE[bit 13],
+    //   and PCID support, CPUID.01H:ECX.PCID[bit 17]
+    eax = 1, ecx = 0;
+    __asm__ __volatile__ ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    pat_supported  = (edx >> 16) & 1;
+    pge_supported  = (edx >> 13) & 1;
+    pcid_supported = (ecx >> 17) & 1;
+
+    // Check for INVPCID support, CPUID.(EAX=07H,ECX=0):EBX.INVPCID[bit 10],
+    uint32_t max_leaf = 0;
+    __asm__ __volatile__ ("cpuid" : "=a"(max_leaf), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0));
+    // and 5 level paging support, CPUID.(EAX=07H,ECX=0):ECX.LA57[bit 16]
+    if (max_leaf >= 7) {
+        eax = 7, ecx = 0;
+        __asm__ __volatile__ ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        invpcid_supported = pcid_supported && ((ebx >> 10) & 1);
+        la57_supported    = (ecx >> 16) & 1;
+    }
+
+    // Use 5 level paging if firmware already enabled it. Otherwise switching to it runs 32 bit code
+    //   without paging, so that code, the PML5 and the handoff page with the GDT, Kernel_Call & 
+    //   stack for the switch need to be below 4GiB. If they can't be, use 4 level paging.
+    uint64_t cr4 = 0;
+    __asm__ __volatile__ ("movq %%CR4, %0\n" : "=r"(cr4));
+    const uint64_t limit_32bit = 0x100000000;
+    bool la57_switch = !(cr4 & CR4_LA57) && la57_supported &&
+                       (uint64_t)arch_setup_and_call_kernel + (2 * PAGE_SIZE) < limit_32bit;
+
+    Page_Table *root_table = la57_switch ? allocate_low_pages(1) : NULL;
+    handoff = la57_switch ? allocate_low_pages(1) : NULL;
+    if (!root_table) root_table = allocate_physical_pages(pa, 1);
+    if (!handoff)    handoff    = allocate_physical_pages(pa, 1);
+    if (!root_table || !handoff) arch_cpu_halt();   // Out of memory for page tables, can't continue
 
-    pt->entries[pt_index] = 0;  // Clear page in page table to unmap the physical address there
+    memset(root_table, 0, sizeof *root_table);  
+    memset(handoff, 0, sizeof *handoff);
+    page_table_pages = 1;
 
-    // Flush the TLB cache for this page
-    __asm__ ("invlpg (%0)\n" : : "r"(virtual_address));
+    la57_switch = la57_switch && (uint64_t)root_table < limit_32bit && (uint64_t)handoff < limit_32bit;
+    if ((cr4 & CR4_LA57) || la57_switch) {
+        paging_levels = 5;
+        pml5 = root_table;
+    } else {
+        paging_levels = 4;
+        pml4 = root_table;
+    }
+
+    // The 5 level paging switch turns paging back on with the new PML5 while still using the 
+    //   handoff page, so identity map it now, while pages can be allocated
+    if (la57_switch) arch_map_range((uint64_t)handoff, (uint64_t)handoff, PAGE_SIZE, MAP_WRITE, pa);
 }
 
-// =============================================================
-// Initialize page tables by setting up new level 4 page table
-// =============================================================
-void arch_init_page_tables(Memory_Map_Info *mmap) {
-    pml4 = mmap_allocate_pages(mmap, 1);
-    memset(pml4, 0, sizeof *pml4);  
+// Can memory be mapped with MAP_WRITE_COMBINE?
+bool arch_write_combine_supported(void) {
+    return pat_supported;
+}
+
+// Get number of page table levels used, 4 or 5
+uint32_t arch_paging_levels(void) {
+    return paging_levels;
+}
+
+// Get PAGING_* features enabled in arch_setup_and_call_kernel()
+uint32_t arch_paging_features(void) {
+    return (pge_supported     ? PAGING_GLOBAL_PAGES : 0) |
+           (pcid_supported    ? PAGING_PCID         : 0) |
+           (invpcid_supported ? PAGING_INVPCID      : 0) |
+           (pat_supported     ? PAGING_PAT          : 0);
+}
+
+// ==========================================================================
+// Process context ID allocator, for the kernel. Each address space gets its 
+//   own PCID so switching between them keeps their TLB entries. PCID 0 is
+//   the loader/kernel page tables. Without PCID support, every address space
+//   uses PCID 0 and page table switches flush the TLB as usual.
+// ==========================================================================
+typedef struct {
+    uint64_t used[MAX_PCIDS / 64];  // 1 bit per PCID, set if allocated
+    uint16_t next_free;             // Hint where to start looking for a free PCID
+    bool     enabled;               // CR4.PCIDE is set, from PAGING_PCID
+} PCID_Allocator;
+
+void init_pcid_allocator(PCID_Allocator *pcids, uint64_t paging_features) {
+    memset(pcids, 0, sizeof *pcids);
+    pcids->used[0]   = 1;   // PCID 0 is always in use
+    pcids->next_free = 1;
+    pcids->enabled   = paging_features & PAGING_PCID;
+}
+
+// Allocate a PCID, or 0 if PCIDs are disabled or all are in use. A newly allocated PCID may still 
+//   have stale TLB entries from its last owner, so switch to it with flush = true the first time.
+uint16_t allocate_pcid(PCID_Allocator *pcids) {
+    if (!pcids->enabled) return 0;
+
+    for (uint16_t i = 0; i < MAX_PCIDS; i++) {
+        uint16_t pcid = (pcids->next_free + i) % MAX_PCIDS;
+        if (pcids->used[pcid / 64] & (1ULL << (pcid % 64))) continue;
+
+        pcids->used[pcid / 64] |= 1ULL << (pcid % 64);
+        pcids->next_free = (pcid + 1) % MAX_PCIDS;
+        return pcid;
+    }
+    return 0;
+}
+
+void free_pcid(PCID_Allocator *pcids, uint16_t pcid) {
+    if (pcid == 0 || pcid >= MAX_PCIDS) return;
+    pcids->used[pcid / 64] &= ~(1ULL << (pcid % 64));
+}
+
+// ==========================================================================
+// Switch to another address space's page tables. Its TLB entries from the 
+//   last time it ran are kept unless flush is set; PCID 0 is always flushed.
+//   Global pages are kept either way.
+// ==========================================================================
+void arch_switch_page_tables(uint64_t pml4_address, uint16_t pcid, bool flush) {
+    uint64_t cr3 = (pml4_address & PHYS_PAGE_ADDR_MASK) | (pcid & CR3_PCID_MASK);
+    if (pcid != 0 && !flush) cr3 |= CR3_NO_FLUSH;
+    __asm__ __volatile__ ("movq %0, %%CR3\n" : : "r"(cr3) : "memory");
+}
+
+
+// ==========================================================================
+// Recursive page table mapping, for the kernel: the loader points one top 
+//   level entry back at the top level table, so every page table entry is 
+//   at a fixed virtual address that only depends on the address it maps & 
+//   its level. Entries are found in constant time without walking tables.
+// ==========================================================================
+uint64_t recursive_slot = 0;            // Top level entry mapping the page tables, from Kernel_Parms
+uint64_t recursive_bases[6] = {0};      // Address of the first entry for each level, 1 = page table
+uint64_t recursive_masks[6] = {0};      // Virtual address bits that select an entry for each level
+
+// ========================================================================
+// Set up kernel page table helpers from what the loader enabled. Call 
+//   first thing in the kernel, as MAP_* flags need NX/PAT/PGE settings.
+// ========================================================================
+void arch_init_kernel_paging(Kernel_Parms *kparms) {
+    paging_levels     = kparms->paging_levels;
+    pge_supported     = kparms->paging_features & PAGING_GLOBAL_PAGES;
+    pcid_supported    = kparms->paging_features & PAGING_PCID;
+    invpcid_supported = kparms->paging_features & PAGING_INVPCID;
+    pat_supported     = kparms->paging_features & PAGING_PAT;
+
+    uint32_t low = 0, high = 0;
+    __asm__ __volatile__ ("rdmsr" : "=a"(low), "=d"(high) : "c"(IA32_EFER));
+    nx_supported = low & EFER_NXE;
+
+    // Each level skipped through the recursive slot moves the virtual address bits down 9 bits,
+    //   with the slot index filling in the top
+    recursive_slot = kparms->recursive_slot;
+    const uint64_t address_bits = 12 + (9 * paging_levels);
+    for (uint64_t level = 1; level <= paging_levels; level++) {
+        uint64_t base = 0;
+        for (uint64_t i = 1; i <= level; i++) base |= recursive_slot << (address_bits - (9 * i));
+        if (base & (1ULL << (address_bits - 1))) base |= ~((1ULL << address_bits) - 1);   // Canonical
+
+        recursive_bases[level] = base;
+        recursive_masks[level] = ((1ULL << (address_bits - (9 * level))) - 1) & ~7ULL;
+    }
 }
 
+// Get the page table entry at a level (1 = page table, paging_levels = top level) for an address
+uint64_t *recursive_entry(uint64_t virtual_address, uint64_t level) {
+    return (uint64_t *)(recursive_bases[level] | ((virtual_address >> (9 * level)) & recursive_masks[level]));
+}
+
+// Get the lowest level entry mapping an address, a 4KiB or large page, or NULL if not mapped
+uint64_t *recursive_leaf_entry(uint64_t virtual_address) {
+    for (uint64_t level = paging_levels; level > 0; level--) {
+        uint64_t *entry = recursive_entry(virtual_address, level);
+        if (!(*entry & PRESENT)) return NULL;
+        if (level == 1 || (*entry & LARGE_PAGE)) return entry;
+    }
+    return NULL;
+}
+
+// Allocate a page table for a missing entry at a level, and clear it through its recursive address
+bool recursive_alloc_table(uint64_t *entry, uint64_t virtual_address, uint64_t level, Page_Allocator *pa) {
+    void *table = allocate_physical_pages(pa, 1);
+    if (!table) return false;
+    *entry = (uint64_t)table | PRESENT | READWRITE | USER;
+
+    uint64_t next_table = (uint64_t)recursive_entry(virtual_address, level-1) & ~(uint64_t)(PAGE_SIZE-1);
+    __asm__ __volatile__ ("invlpg (%0)\n" : : "r"(next_table) : "memory");
+    memset((void *)next_table, 0, PAGE_SIZE);
+    return true;
+}
+
+// ==========================================================================
+// Map a 4KiB page with MAP_* flags. Missing page tables are allocated and 
+//   cleared through their own recursive addresses. Returns false if out of
+//   memory or the address is in a large page.
+// ==========================================================================
+bool recursive_map_page(uint64_t physical_address, uint64_t virtual_address, uint32_t map_flags, 
+                        Page_Allocator *pa) {
+    for (uint64_t level = paging_levels; level > 1; level--) {
+        uint64_t *entry = recursive_entry(virtual_address, level);
+        if (*entry & LARGE_PAGE) return false;
+        if (!(*entry & PRESENT) && !recursive_alloc_table(entry, virtual_address, level, pa)) return false;
+    }
+
+    *recursive_entry(virtual_address, 1) = (physical_address & PHYS_PAGE_ADDR_MASK) | page_flags(map_flags);
+    __asm__ __volatile__ ("invlpg (%0)\n" : : "r"(virtual_address) : "memory");
+    return true;
+}
+
+// Unmap the page mapping an address; a large page is unmapped as a whole
+void recursive_unmap_page(uint64_t virtual_address) {
+    uint64_t *entry = recursive_leaf_entry(virtual_address);
+    if (!entry) return;
+
+    *entry = 0;
+    __asm__ __volatile__ ("invlpg (%0)\n" : : "r"(virtual_address) : "memory");
+}
+
+// Change the MAP_* flags of the page mapping an address; returns false if not mapped
+bool recursive_protect_page(uint64_t virtual_address, uint32_t map_flags) {
+    uint64_t *entry = recursive_leaf_entry(virtual_address);
+    if (!entry) return false;
+
+    *entry = (*entry & (PHYS_PAGE_ADDR_MASK | LARGE_PAGE)) | page_flags(map_flags);
+    __asm__ __volatile__ ("invlpg (%0)\n" : : "r"(virtual_address) : "memory");
+    return true;
+}
+
+// ==========================================================================
+// Lazy direct map, for the kernel: with PAGING_LAZY_DIRECT_MAP, the loader 
+//   only maps memory needed at kernel entry, and reserves the top level 
+//   page tables for the rest. Page faults in the direct map fill in the 
+//   missing 2MiB or 4KiB page, through the recursive page table mapping.
+// ==========================================================================
+
+// Interrupt descriptor table entry, 64 bit interrupt gate
+typedef struct {
+    uint16_t offset_15_0;
+    uint16_t selector;          // Code segment, offset in GDT
+    uint8_t  ist;               // Interrupt stack table index, 0 = current stack
+    uint8_t  type_attributes;   // Present, DPL & gate type
+    uint16_t offset_31_16;
+    uint32_t offset_63_32;
+    uint32_t reserved;
+} IDT_Entry;
+
+#define PAGE_FAULT_VECTOR   14
+#define INTERRUPT_GATE      0x8E    // Present, DPL 0, 64 bit interrupt gate
+#define PF_PRESENT          (1 << 0)    // Page fault error code: page was present, i.e. not a missing page
+
+IDT_Entry idt[32];                      // CPU exceptions only
+Kernel_Parms *lazy_map_kparms = NULL;   // Direct map base, memory map & paging features
+
+// Page fault entry: save registers the handler can change, call it with the faulting address 
+//   and error code (MS ABI, same in ELF & PE kernels), then drop the error code and return to
+//   retry the access. 0x228 bytes keeps the FXSAVE area and the call 16 byte aligned.
+extern void arch_page_fault_stub(void);
+__asm__(
+    ".pushsection .text\n"
+    ".balign 16\n"
+    "arch_page_fault_stub:\n"
+    "pushq %rax\n"
+    "pushq %rcx\n"
+    "pushq %rdx\n"
+    "pushq %rsi\n"
+    "pushq %rdi\n"
+    "pushq %r8\n"
+    "pushq %r9\n"
+    "pushq %r10\n"
+    "pushq %r11\n"
+    "subq $0x228, %rsp\n"         // 32 byte shadow space + 512 byte FXSAVE area + alignment
+    "fxsave64 0x20(%rsp)\n"
+    "movq %cr2, %rcx\n"
+    "movq 0x270(%rsp), %rdx\n"     // Error code, above saved registers
+    "call arch_page_fault_handler\n"
+    "fxrstor64 0x20(%rsp)\n"
+    "addq $0x228, %rsp\n"
+    "popq %r11\n"
+    "popq %r10\n"
+    "popq %r9\n"
+    "popq %r8\n"
+    "popq %rdi\n"
+    "popq %rsi\n"
+    "popq %rdx\n"
+    "popq %rcx\n"
+    "popq %rax\n"
+    "addq $8, %rsp\n"
+    "iretq\n"
+    ".popsection\n"
+);
+
+// ======================================================================
+// Map the missing direct map page for a virtual address if it's in the 
+//   memory map, with its descriptor's cacheability: a 2MiB page if all 
+//   of it is in the descriptor, else a 4KiB page. Missing page 
+//   directories & page tables come from the kernel's page allocator.
+// ======================================================================
+bool lazy_map_page(uint64_t virtual_address) {
+    const uint64_t direct_map_base = lazy_map_kparms->direct_map_base;
+    if (virtual_address < direct_map_base) return false;
+
+    uint64_t physical_address = virtual_address - direct_map_base;
+    Memory_Map_Info *mmap = &lazy_map_kparms->mmap;
+    EFI_MEMORY_DESCRIPTOR *desc = NULL;
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size && !desc; i++) {
+        EFI_MEMORY_DESCRIPTOR *next = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+
+        if (physical_address >= next->PhysicalStart && 
+            physical_address - next->PhysicalStart < next->NumberOfPages * PAGE_SIZE)
+            desc = next;
+    }
+    if (!desc) return false;
+
+    // Top level page tables must have been reserved by the loader
+    for (uint64_t level = paging_levels; level > 3; level--) {
+        uint64_t entry = *recursive_entry(virtual_address, level);
+        if (!(entry & PRESENT) || (entry & LARGE_PAGE)) return false;
+    }
+
+    Page_Allocator *pa = &lazy_map_kparms->page_allocator;
+    uint64_t *pdpte = recursive_entry(virtual_address, 3);
+    if (*pdpte & LARGE_PAGE) return false;
+    if (!(*pdpte & PRESENT) && !recursive_alloc_table(pdpte, virtual_address, 3, pa)) return false;
+
+    const uint64_t flags = page_flags(direct_map_flags(desc->Type, desc->Attribute));
+    uint64_t *pde = recursive_entry(virtual_address, 2);
+    if (*pde & LARGE_PAGE) return false;
+    if (!(*pde & PRESENT)) {
+        uint64_t large_start = physical_address & ~(uint64_t)(LARGE_PAGE_SIZE-1);
+        uint64_t desc_end    = desc->PhysicalStart + (desc->NumberOfPages * PAGE_SIZE);
+        if (large_start >= desc->PhysicalStart && large_start + LARGE_PAGE_SIZE <= desc_end) {
+            *pde = large_start | flags | LARGE_PAGE;
+            return true;
+        }
+        if (!recursive_alloc_table(pde, virtual_address, 2, pa)) return false;
+    }
+
+    // 2MiB page crosses the descriptor's edge or is partly mapped, fill in the 4KiB page
+    uint64_t *pte = recursive_entry(virtual_address, 1);
+    if (*pte & PRESENT) return false;
+    *pte = (physical_address & PHYS_PAGE_ADDR_MASK) | flags;
+    return true;
+}
+
+// Page fault handler; anything the lazy direct map doesn't cover is fatal
+void EFIAPI arch_page_fault_handler(uint64_t address, uint64_t error_code) {
+    if (!(error_code & PF_PRESENT) && lazy_map_kparms && lazy_map_page(address)) return;
+    arch_cpu_halt();
+}
+
+// Can the kernel fill in the direct map on page faults, for PAGING_LAZY_DIRECT_MAP?
+bool arch_lazy_mapping_supported(void) {
+    return true;
+}
+
+// ==========================================================================
+// Set up the IDT with the page fault handler for the lazy direct map. Call
+//   after arch_init_kernel_paging(), before touching anything outside of
+//   the kernel, stack & Kernel_Parms.
+// ==========================================================================
+void arch_init_lazy_mapping(Kernel_Parms *kparms) {
+    lazy_map_kparms = kparms;
+
+    uint64_t handler = (uint64_t)arch_page_fault_stub;
+    uint16_t cs = 0;
+    __asm__ __volatile__ ("movw %%CS, %0\n" : "=r"(cs));
+    idt[PAGE_FAULT_VECTOR] = (IDT_Entry){
+        .offset_15_0     = handler & 0xFFFF,
+        .selector        = cs,
+        .type_attributes = INTERRUPT_GATE,
+        .offset_31_16    = (handler >> 16) & 0xFFFF,
+        .offset_63_32    = handler >> 32,
+    };
+
+    Descriptor_Register idtr = {.limit = sizeof idt - 1, .base = (uint64_t)idt};
+    __asm__ __volatile__ ("lidt %0\n" : : "m"(idtr));
+}
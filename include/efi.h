@@ -112,6 +112,10 @@ typedef UINT64 EFI_VIRTUAL_ADDRESS;
 {0xCE345171,0xBA0B,0x11d2,\
 0x8e,0x4F,{0x00,0xa0,0xc9,0x69,0x72,0x3b}}
 
+#define EFI_DISK_IO2_PROTOCOL_GUID \
+{0x151c8eae,0x7f2c,0x472c,\
+0x9e,0x54,{0x98,0x28,0x19,0x4f,0x6a,0x88}}
+
 #define EFI_PARTITION_INFO_PROTOCOL_GUID \
 {0x8cf2f62c, 0xbc9b, 0x4821,\
 0x80, 0x8d, {0xec, 0x9e, 0xc4, 0x21, 0xa1, 0xa0}}
@@ -197,17 +201,21 @@ typedef UINT64 EFI_VIRTUAL_ADDRESS;
 #define ENCODE_ERROR(x) (TOP_BIT | (x))
 #define EFI_ERROR(x) ((INTN)((UINTN)(x)) < 0)
 
-#define EFI_UNSUPPORTED      ENCODE_ERROR(3)
-#define EFI_BUFFER_TOO_SMALL ENCODE_ERROR(5)
-#define EFI_DEVICE_ERROR     ENCODE_ERROR(7)
-#define EFI_NOT_FOUND        ENCODE_ERROR(14)
-#define EFI_CRC_ERROR        ENCODE_ERROR(27)
+#define EFI_INVALID_PARAMETER ENCODE_ERROR(2)
+#define EFI_UNSUPPORTED       ENCODE_ERROR(3)
+#define EFI_BUFFER_TOO_SMALL  ENCODE_ERROR(5)
+#define EFI_DEVICE_ERROR      ENCODE_ERROR(7)
+#define EFI_VOLUME_CORRUPTED  ENCODE_ERROR(10)
+#define EFI_NOT_FOUND         ENCODE_ERROR(14)
+#define EFI_CRC_ERROR         ENCODE_ERROR(27)
 
 #define MAX_EFI_ERROR 36
 const CHAR16 *EFI_ERROR_STRINGS[MAX_EFI_ERROR] = {
+    [2]  = u"EFI_INVALID_PARAMETER",
     [3]  = u"EFI_UNSUPPORTED",
     [5]  = u"EFI_BUFFER_TOO_SMALL",
     [7]  = u"EFI_DEVICE_ERROR",
+    [10] = u"EFI_VOLUME_CORRUPTED",
     [14] = u"EFI_NOT_FOUND",
     [27] = u"EFI_CRC_ERROR",
 };
@@ -970,6 +978,13 @@ EFI_STATUS
     IN UINTN      MapKey
 );
 
+// EFI_STALL: UEFI Spec 2.10 section 7.5.2
+typedef
+EFI_STATUS
+(EFIAPI *EFI_STALL) (
+    IN UINTN Microseconds
+);
+
 // EFI_SET_WATCHDOG_TIMER: UEFI Spec 2.10 7.5.1
 typedef
 EFI_STATUS
@@ -1456,6 +1471,64 @@ typedef struct EFI_DISK_IO_PROTOCOL {
     EFI_DISK_WRITE WriteDisk;
 } EFI_DISK_IO_PROTOCOL;
 
+// EFI_DISK_IO2_PROTOCOL: UEFI Spec 2.10 section 13.8.1
+#define EFI_DISK_IO2_PROTOCOL_REVISION 0x00020000
+
+typedef struct EFI_DISK_IO2_PROTOCOL EFI_DISK_IO2_PROTOCOL; 
+
+// EFI_DISK_IO2_TOKEN
+typedef struct {
+    EFI_EVENT  Event;
+    EFI_STATUS TransactionStatus;
+} EFI_DISK_IO2_TOKEN;
+
+// EFI_DISK_CANCEL_EX: UEFI Spec 2.10 section 13.8.2
+typedef
+EFI_STATUS
+(EFIAPI *EFI_DISK_CANCEL_EX) (
+    IN EFI_DISK_IO2_PROTOCOL *This
+);
+
+// EFI_DISK_READ_EX: UEFI Spec 2.10 section 13.8.3
+typedef
+EFI_STATUS
+(EFIAPI *EFI_DISK_READ_EX) (
+    IN EFI_DISK_IO2_PROTOCOL  *This,
+    IN UINT32                 MediaId,
+    IN UINT64                 Offset,
+    IN OUT EFI_DISK_IO2_TOKEN *Token,
+    IN UINTN                  BufferSize,
+    OUT VOID                  *Buffer
+);
+
+// EFI_DISK_WRITE_EX: UEFI Spec 2.10 section 13.8.4
+typedef
+EFI_STATUS
+(EFIAPI *EFI_DISK_WRITE_EX) (
+    IN EFI_DISK_IO2_PROTOCOL  *This,
+    IN UINT32                 MediaId,
+    IN UINT64                 Offset,
+    IN OUT EFI_DISK_IO2_TOKEN *Token,
+    IN UINTN                  BufferSize,
+    IN VOID                   *Buffer
+);
+
+// EFI_DISK_FLUSH_EX: UEFI Spec 2.10 section 13.8.5
+typedef
+EFI_STATUS
+(EFIAPI *EFI_DISK_FLUSH_EX) (
+    IN EFI_DISK_IO2_PROTOCOL  *This,
+    IN OUT EFI_DISK_IO2_TOKEN *Token
+);
+
+typedef struct EFI_DISK_IO2_PROTOCOL {
+    UINT64             Revision;
+    EFI_DISK_CANCEL_EX Cancel;
+    EFI_DISK_READ_EX   ReadDiskEx;
+    EFI_DISK_WRITE_EX  WriteDiskEx;
+    EFI_DISK_FLUSH_EX  FlushDiskEx;
+} EFI_DISK_IO2_PROTOCOL;
+
 // EFI_PARTITION_INFO_PROTOCOL: UEFI Spec 2.10 section 13.18
 #define EFI_PARTITION_INFO_PROTOCOL_REVISION 0x0001000
 #define PARTITION_TYPE_OTHER                 0x00
@@ -1717,7 +1790,7 @@ typedef struct {
     // Miscellaneous Services
     //
     void*                  GetNextMonotonicCount;
-    void*                  Stall;
+    EFI_STALL              Stall;
     EFI_SET_WATCHDOG_TIMER SetWatchdogTimer;
 
     //
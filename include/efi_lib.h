@@ -15,11 +15,13 @@
 // -----------------
 #define ARRAY_SIZE(x) (sizeof (x) / sizeof (x)[0])
 #define max(x, y) ((x) > (y) ? (x) : (y))
+#define min(x, y) ((x) < (y) ? (x) : (y))
 
 // -----------------
 // Global constants
 // -----------------
 #define PAGE_SIZE 4096  // 4KiB
+#define LARGE_PAGE_SIZE 0x200000    // 2MiB
 
 // ELF Header - x86_64
 typedef struct {
@@ -75,6 +77,13 @@ typedef enum {
     PT_LOAD = 0x1,  // Loadable
 } ELF_PHEADER_TYPE;
 
+// Elf Program header p_flags values
+typedef enum {
+    PF_X = 0x1,     // Executable
+    PF_W = 0x2,     // Writable
+    PF_R = 0x4,     // Readable
+} ELF_PHEADER_FLAGS;
+
 // PE Structs/types
 // PE32+ COFF File Header
 typedef struct {
@@ -144,6 +153,11 @@ typedef struct {
     UINT32 Characteristics;
 }__attribute__ ((packed)) PE_Section_Header_64;
 
+// Section Header Characteristics
+#define IMAGE_SCN_MEM_EXECUTE 0x20000000
+#define IMAGE_SCN_MEM_READ    0x40000000
+#define IMAGE_SCN_MEM_WRITE   0x80000000
+
 // Timer event context is the text mode screen bounds
 typedef struct {
     UINT32 rows; 
@@ -159,6 +173,145 @@ typedef struct {
     UINT32                desc_version;
 } Memory_Map_Info;
 
+// Info for a file in the disk image's data partition, from the ESP file manifest
+#define DATA_FILE_NAME_LEN 48
+typedef struct {
+    char    name[DATA_FILE_NAME_LEN];   // File name e.g. "kernel.elf"
+    EFI_LBA disk_lba;                   // Starting LBA of file data on disk
+    UINT64  size;                       // File size in bytes
+    UINT32  checksum;                   // CRC32C of file data on disk, if has_checksum
+    bool    has_checksum;               
+} Data_File_Entry;
+
+// Index of all files in the data partition, built once per boot. Names are looked up 
+//   in an open addressing hash table of indexes into the entries array.
+typedef struct {
+    bool            built;          // Has the index been built yet?
+    UINT64          disk_size;      // Size of entire disk image in bytes
+    UINTN           num_entries;    // Number of files in entries array
+    Data_File_Entry *entries;       // Array of file info
+    UINTN           num_slots;      // Hash table size, power of 2
+    UINT16          *slots;         // Hash table; entry index + 1, or 0 if empty. Max 65534 files.
+} Data_Partition_Index;
+
+// Binary file manifest (FILE.BIN) in the ESP, used instead of FILE.TXT if found: 
+//   a header followed by num_entries entries, fixed size records without any text parsing
+#define DATA_MANIFEST_MAGIC 0x58444946  // "FIDX" 
+typedef struct {
+    UINT32 magic;           // DATA_MANIFEST_MAGIC
+    UINT32 version;         // 1
+    UINT32 num_entries;     // Number of entries after header
+    UINT32 entry_size;      // Size of each entry; allows growing entries in later versions
+    UINT64 disk_size;       // Size of entire disk image in bytes
+} Data_Manifest_Header;
+
+typedef struct {
+    char   name[DATA_FILE_NAME_LEN];    // NULL padded file name
+    UINT64 disk_lba;                    // Starting LBA of file data on disk
+    UINT64 size;                        // File size in bytes
+    UINT32 checksum;                    // CRC32C of file data on disk
+    UINT32 flags;                       // DATA_MANIFEST_HAS_CHECKSUM
+} Data_Manifest_Entry;
+
+#define DATA_MANIFEST_HAS_CHECKSUM 0x1
+
+// Block IO protocol handle for a disk or partition, in the disk device registry
+typedef struct {
+    EFI_HANDLE                  handle;
+    EFI_BLOCK_IO_PROTOCOL       *biop;
+    EFI_PARTITION_INFO_PROTOCOL *pip;   // Partition info, or NULL if not a partition/not found
+} Block_IO_Handle;
+
+// Disk device (one media ID) with all of its Block IO handles
+typedef struct {
+    UINT32                media_id;
+    EFI_HANDLE            handle;           // Entire disk handle, or NULL if not found
+    EFI_BLOCK_IO_PROTOCOL *biop;            // Entire disk Block IO protocol
+    EFI_DISK_IO_PROTOCOL  *diop;            // Entire disk Disk IO protocol
+    EFI_DISK_IO2_PROTOCOL *diop2;           // Entire disk Disk IO 2 protocol, or NULL if not supported
+    UINT32                block_size;
+    UINT32                io_align;         // Buffer alignment needed for IO, 0 or 1 = none
+    UINT32                optimal_transfer_blocks;  // Optimal IO size granularity in blocks, 0 = any
+    UINT8                 *bounce;          // IoAlign aligned buffer for unaligned reads, or NULL
+    EFI_PHYSICAL_ADDRESS  bounce_buffer;    // Pages allocated for bounce buffer
+    UINTN                 bounce_pages;
+    UINT64                read_calls;       // Read engine calls, bytes and timestamp ticks for
+    UINT64                bytes_read;       //   throughput of synchronous reads from this disk
+    UINT64                read_ticks;       
+    UINTN                 num_handles;      // Number of Block IO handles; entire disk is first if found
+    Block_IO_Handle       *handles;         // Block IO handles for entire disk and partitions
+} Disk_Device;
+
+// Registry of all disk devices, built once from the handle database on first use
+typedef struct {
+    bool            built;          // Has the registry been built yet?
+    UINT32          image_media_id; // Media ID of disk this running image was loaded from
+    UINTN           num_devices;
+    Disk_Device     *devices;
+    UINTN           num_handles;
+    Block_IO_Handle *handles;       // All Block IO handles, grouped by device
+} Disk_Registry;
+
+typedef struct LZ4_Stream LZ4_Stream;
+
+// File in the disk image's data partition, opened to read from disk directly
+typedef struct {
+    Disk_Device *device;        // Disk the file is on
+    UINT64      disk_offset;    // Byte offset of start of file on disk
+    UINTN       size;           // File size in bytes; decompressed size if compressed
+    LZ4_Stream  *lz4;           // Decompression state if file is LZ4 compressed, else NULL
+    UINT8       *memory;        // File data if already in memory e.g. boot bundle, else NULL
+    bool        verify;         // Checksum file data as it is read, to check against manifest
+    UINT32      expected_crc;   // CRC32C of file data on disk from manifest
+    UINT32      crc;            // Running CRC32C (not inverted) of file data before crc_offset
+    UINT64      crc_offset;     // File data is checksummed up to this offset
+} Data_File;
+
+// Batch of asynchronous data file reads in flight, to overlap disk IO with other work
+#define MAX_DATA_FILE_READS 32
+typedef struct {
+    UINTN              count;                       // Number of tokens in use
+    EFI_DISK_IO2_TOKEN tokens[MAX_DATA_FILE_READS]; // Disk IO 2 tokens for pending reads
+    struct {
+        Data_File *file;
+        UINT64    offset;
+        UINTN     size;
+        VOID      *buffer;
+    } pending[MAX_DATA_FILE_READS];                 // Reads to checksum when done
+    EFI_STATUS         status;                      // First error found for any read in batch
+} Data_File_Reads;
+
+// LZ4 frame format values, from lz4_Frame_format.md in the LZ4 project
+#define LZ4_FRAME_MAGIC            0x184D2204
+#define LZ4_FRAME_MAX_HEADER_SIZE  19           // Magic, FLG, BD, content size, dict ID, HC
+#define LZ4_FLG_VERSION_MASK       0xC0
+#define LZ4_FLG_VERSION            0x40         // Version 01
+#define LZ4_FLG_BLOCK_INDEPENDENT  0x20
+#define LZ4_FLG_BLOCK_CHECKSUM     0x10
+#define LZ4_FLG_CONTENT_SIZE       0x08
+#define LZ4_FLG_DICT_ID            0x01
+#define LZ4_BLOCK_UNCOMPRESSED     0x80000000   // Block size high bit: block data is stored as is
+
+// Forward only streaming decompression of an LZ4 frame in a data partition file; one block 
+//   is decompressed while the next compressed block is read from disk
+typedef struct LZ4_Stream {
+    Data_File       raw;                // Compressed file on disk
+    UINT64          first_block;        // Offset of first block header in compressed file
+    UINTN           max_block_size;     // Max decompressed size of any block
+    bool            block_checksum;     // Each block's data is followed by a 4 byte checksum
+    UINT32          next_block;         // Header of next block; size & uncompressed bit, 0 = end
+    UINT64          next_block_offset;  // Offset of next block's data in compressed file
+    UINT8           *in[2];             // Compressed block buffers, for reading & decompressing
+    UINTN           in_index;           // Buffer the next block is being read into
+    Data_File_Reads reads;              // Pending read for next block
+    UINT64          out_offset;         // Decompressed offset of next block
+    UINT8           *block;             // Last block, if not decompressed into caller's buffer
+    UINT64          block_offset;       // Decompressed offset of block buffer data
+    UINTN           block_len;          // Bytes in block buffer, 0 if none
+    UINT64          read_ticks;         // Timestamp ticks spent reading/waiting on disk
+    UINT64          decompress_ticks;   // Timestamp ticks spent decompressing
+} LZ4_Stream;
+
 // Bitmapped font info (assuming monospaced)
 typedef struct {
     char     *name;             // Font name
@@ -170,6 +323,54 @@ typedef struct {
                                 //   e.g. PSF font, or right->left e.g. terminus?
 } Bitmap_Font;
 
+// Module loaded for the kernel from the boot bundle, e.g. an initrd or other files
+typedef struct {
+    char     *name;             // File name in bundle
+    uint64_t address;           // Physical address of module data
+    uint64_t size;              // Size in bytes
+} Boot_Module;
+
+// Boot bundle: cpio "newc" archive in the data partition holding the kernel, fonts and any other
+//   modules, read from disk with one read into one allocation
+#define BOOT_BUNDLE_NAME "bundle"
+#define CPIO_NEWC_MAGIC  "070701"
+#define CPIO_NEWC_HEADER_SIZE 110
+#define CPIO_TRAILER     "TRAILER!!!"
+typedef struct {
+    EFI_PHYSICAL_ADDRESS address;       // Archive data
+    UINTN                pages;         // Pages allocated for archive data
+    UINTN                num_modules;   
+    Boot_Module          *modules;      // Regular files in archive
+} Boot_Bundle;
+
+// Boot stage profiler: a timestamp is recorded at the end of each loader stage, and the timeline 
+//   is passed to the kernel
+#define MAX_BOOT_STAGES 32
+typedef struct {
+    char     *name;             // Stage that ended at this timestamp
+    uint64_t ticks;             // Timestamp counter value
+} Boot_Stage;
+
+typedef struct {
+    uint64_t   ticks_per_second;        // Timestamp counter frequency, 0 if not calibrated
+    uint64_t   start;                   // Timestamp at loader entry
+    uint32_t   num_stages;
+    Boot_Stage stages[MAX_BOOT_STAGES];
+} Boot_Profile;
+
+// Physical page allocator, set up from the final EFI memory map right before 
+//   ExitBootServices(): 1 bit per page of physical memory from address 0, set = used. The kernel
+//   keeps using it. Until then there is no bitmap, and pages come from a pool of EfiLoaderData 
+//   memory instead; what's left of the pool is free in the bitmap.
+typedef struct {
+    uint64_t *bitmap;       
+    uint64_t pages;         // Pages tracked in bitmap
+    uint64_t free_pages;
+    uint64_t next_free;     // Bitmap word to start searching from; all words before it are full
+    EFI_PHYSICAL_ADDRESS pool;  // Next free pool page, without a bitmap
+    uint64_t pool_pages;        // Pages left in pool
+} Page_Allocator;
+
 // Example Kernel Parameters
 typedef struct {
     Memory_Map_Info                   mmap; 
@@ -179,11 +380,58 @@ typedef struct {
     EFI_CONFIGURATION_TABLE           *ConfigurationTable;
     UINTN                             num_fonts;
     Bitmap_Font                       *fonts;
+    UINTN                             num_modules;
+    Boot_Module                       *modules;
+    Boot_Profile                      profile;
+    UINTN                             page_table_pages;     // Pages used for loader page tables
+    Page_Allocator                    page_allocator;
+    UINT64                            direct_map_base;  // All memory is mapped at this + physical address
+    UINT64                            framebuffer_cache_type;   // EFI_MEMORY_WC or EFI_MEMORY_UC
+    UINT64                            paging_features;  // PAGING_* features enabled by the loader
+    UINT64                            paging_levels;    // Page table levels, e.g. 4, or 5 for x86_64 LA57
+    UINT64                            recursive_slot;   // Top level page table entry mapping the page tables
 } Kernel_Parms;
 
 // Kernel entry point typedef
 typedef void EFIAPI (*Entry_Point)(Kernel_Parms *);
 
+// Memory mapping permissions, for arch_map_range(); mapped memory is always readable
+enum {
+    MAP_WRITE   = (1 << 0),
+    MAP_EXECUTE = (1 << 1),
+    MAP_USER    = (1 << 2),     // Accessible from user mode
+    MAP_WRITE_COMBINE = (1 << 3),   // Write combining memory type e.g. for framebuffers
+    MAP_GLOBAL  = (1 << 4),     // Shared by all address spaces; TLB entries kept on page table switches
+    MAP_DEVICE  = (1 << 5),     // Uncached device memory type e.g. for MMIO
+};
+
+// Paging features enabled by the loader, passed to the kernel in Kernel_Parms
+enum {
+    PAGING_GLOBAL_PAGES = (1 << 0), // MAP_GLOBAL mappings are kept in the TLB across address spaces
+    PAGING_PCID         = (1 << 1), // TLB entries are tagged with a process context ID
+    PAGING_INVPCID      = (1 << 2), // Single PCID/address TLB entries can be invalidated
+    PAGING_LAZY_DIRECT_MAP = (1 << 3),  // Direct map only has memory needed at kernel entry;
+                                        //   the kernel maps the rest on page faults
+    PAGING_PAT          = (1 << 4), // MAP_WRITE_COMBINE maps write combining, through the PAT on x86_64
+};
+
+// Direct map permissions; supervisor only and not executable, except for runtime services code
+#define DIRECT_MAP_FLAGS (MAP_WRITE | MAP_GLOBAL)
+
+// Loaded kernel segments, from ELF program headers or PE section headers, to map each part of 
+//   the kernel with its own permissions
+#define MAX_KERNEL_SEGMENTS 16
+typedef struct {
+    UINTN  offset;      // Offset from start of loaded kernel buffer
+    UINTN  size;
+    UINT32 flags;       // MAP_* flags
+} Kernel_Segment;
+
+typedef struct {
+    UINTN          count;
+    Kernel_Segment segments[MAX_KERNEL_SEGMENTS];
+} Kernel_Segments;
+
 // EFI Configuration Table GUIDs and string names
 typedef struct {
     EFI_GUID guid;
@@ -242,6 +490,10 @@ EFI_HANDLE image = NULL;                        // Image handle
 
 INT32 text_rows = 0, text_cols = 0;             // Current text mode screen rows & columns
 
+Data_Partition_Index data_index = {0};          // Index of data partition files
+Disk_Registry disk_registry = {0};              // Disk devices and their Block IO/Disk IO protocols
+Boot_Profile boot_profile = {0};                // Loader boot stage timestamps
+
 // ======================
 // Set global variables
 // ======================
@@ -292,6 +544,32 @@ VOID *memcpy(VOID *dst, VOID *src, UINTN len) {
     return dst;
 }
 
+// ====================================
+// memmove for compiling with clang/gcc:
+// Sets len bytes of dst memory from src,
+//   where memory can overlap: copies forward
+//   if dst is below src, else backward.
+//   Copies 8 bytes at a time when dst & src
+//   are aligned the same.
+// Returns dst buffer
+// ================================
+VOID *memmove(VOID *dst, VOID *src, UINTN len) {
+    UINT8 *p = dst, *q = src;
+    const BOOLEAN words = (((UINTN)p ^ (UINTN)q) & 7) == 0;
+
+    if (p <= q || p >= q + len) {
+        for (; words && len > 0 && ((UINTN)p & 7); len--) *p++ = *q++;
+        for (; words && len >= 8; len -= 8, p += 8, q += 8) *(UINT64 *)p = *(UINT64 *)q;
+        while (len--) *p++ = *q++;
+    } else {
+        p += len, q += len;
+        for (; words && len > 0 && ((UINTN)p & 7); len--) *--p = *--q;
+        for (; words && len >= 8; len -= 8) p -= 8, q -= 8, *(UINT64 *)p = *(UINT64 *)q;
+        while (len--) *--p = *--q;
+    }
+    return dst;
+}
+
 // =============================================================================
 // memcmp:
 // Compare up to len bytes of m1 and m2, stop at first
@@ -445,6 +723,26 @@ INTN atoi(char *s) {
     return result;
 }
 
+// =============================================
+// (ASCII) xtoi: 
+// Converts intial hex value of input string to 
+//   unsigned int, with or without a "0x" prefix.
+// Returns converted value or 0 on error
+// =============================================
+UINTN xtoi(char *s) {
+    UINTN result = 0;
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) s += 2;
+
+    for (;; s++) {
+        if      (*s >= '0' && *s <= '9') result = (result << 4) | (*s - '0');
+        else if (*s >= 'a' && *s <= 'f') result = (result << 4) | (*s - 'a' + 10);
+        else if (*s >= 'A' && *s <= 'F') result = (result << 4) | (*s - 'A' + 10);
+        else break;
+    }
+
+    return result;
+}
+
 // ======================================================
 // (ASCII) itoa:
 //  Convert integer to string representation.
@@ -512,6 +810,17 @@ char *stpcpy(char *dst, char *src) {
     return dst;
 }
 
+// ================================
+// (ASCII) strcmp:
+//   Compare 2 strings, each character
+//   Returns difference in strings at last point of comparison:
+//   0 if strings are equal, <0 if s2 is greater, >0 if s1 is greater
+// ================================
+INTN strcmp(char *s1, char *s2) {
+    while (*s1 && *s1 == *s2) s1++, s2++;
+    return (INTN)(UINT8)*s1 - (INTN)(UINT8)*s2;
+}
+
 // ================================
 // CHAR16 strncmp:
 //   Compare 2 strings, each character, up to at most len bytes
@@ -1747,74 +2056,396 @@ VOID *read_esp_file_to_buffer(CHAR16 *path, UINTN *file_size) {
     return file_buffer; 
 }
 
-// =================================================================
-// Read a file from a given disk (from input media ID), into an
-//   output buffer. 
-//
-// Returns: non-null pointer to allocated buffer with data, 
-//  allocated with Boot Services AllocatePool(), or NULL if not 
-//  found or error. If executable input parameter is true, then 
-//  allocate EfiLoaderCode memory type, else use EfiLoaderData.
-//
-//  NOTE: Caller will have to use FreePool() on returned buffer to 
-//    free allocated memory.
-// =================================================================
-EFI_PHYSICAL_ADDRESS 
-read_disk_lbas_to_buffer(EFI_LBA disk_lba, UINTN data_size, UINT32 disk_mediaID, bool executable) {
-    EFI_PHYSICAL_ADDRESS buffer = 0;
+// =======================================================================
+// Build the disk device registry: find all Block IO protocol handles 
+//   once, and group them by media ID with the entire disk's Block IO &
+//   Disk IO protocols, partition info, and IO size/alignment values.
+//   All disk paths use the registry instead of searching the handle 
+//   database again for each read.
+// =======================================================================
+EFI_STATUS build_disk_registry(void) {
     EFI_STATUS status = EFI_SUCCESS;
-
-    // Loop through and get Block IO protocol for input media ID, for entire disk
-    //   NOTE: This assumes the first Block IO found with logical partition false is the entire disk
-    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
-    EFI_BLOCK_IO_PROTOCOL *biop;
+    EFI_GUID bio_guid  = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_GUID dio_guid  = EFI_DISK_IO_PROTOCOL_GUID;
+    EFI_GUID dio2_guid = EFI_DISK_IO2_PROTOCOL_GUID;
+    EFI_GUID pi_guid   = EFI_PARTITION_INFO_PROTOCOL_GUID;
+    EFI_GUID lip_guid  = EFI_LOADED_IMAGE_PROTOCOL_GUID;
     UINTN num_handles = 0;
     EFI_HANDLE *handle_buffer = NULL;
+    Block_IO_Handle *found = NULL;
+
+    if (disk_registry.built) return EFI_SUCCESS;
 
     status = bs->LocateHandleBuffer(ByProtocol, &bio_guid, NULL, &num_handles, &handle_buffer);
     if (EFI_ERROR(status)) {
         error(status, u"Could not locate any Block IO Protocols.\r\n");
-        goto done;
+        goto cleanup;
     }
 
-    BOOLEAN found = false;
-    UINTN i = 0;
-    for (; i < num_handles; i++) {
+    // Allocate for the worst case of each handle being its own device, plus a temporary list
+    //   of handles in the order they were found
+    status = bs->AllocatePool(EfiLoaderData, 
+                              (num_handles * sizeof *disk_registry.devices) + 
+                              (num_handles * sizeof *disk_registry.handles * 2),
+                              (VOID **)&disk_registry.devices);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not allocate disk device registry.\r\n");
+        goto cleanup;
+    }
+    disk_registry.handles = (Block_IO_Handle *)(disk_registry.devices + num_handles);
+    found = disk_registry.handles + num_handles;
+
+    // Get Block IO protocol for each handle, and each unique media ID as a new device
+    UINTN num_found = 0;
+    disk_registry.num_devices = 0;
+    for (UINTN i = 0; i < num_handles; i++) {
+        EFI_BLOCK_IO_PROTOCOL *biop = NULL;
         status = bs->OpenProtocol(handle_buffer[i], 
                                   &bio_guid,
                                   (VOID **)&biop,
                                   image,
                                   NULL,
                                   EFI_OPEN_PROTOCOL_GET_PROTOCOL);
-
         if (EFI_ERROR(status)) {
             fprintf_c16(cerr, u"Could not Open Block IO protocol on handle %u.\r\n", i);
             continue;
         }
 
-        if (biop->Media->MediaId == disk_mediaID && !biop->Media->LogicalPartition) {
-            found = true;
-            break;
-        }
+        found[num_found] = (Block_IO_Handle){ .handle = handle_buffer[i], .biop = biop };
+        if (biop->Media->LogicalPartition) 
+            bs->OpenProtocol(handle_buffer[i],  // Not all partitions will have partition info
+                             &pi_guid,
+                             (VOID **)&found[num_found].pip,
+                             image,
+                             NULL,
+                             EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+        num_found++;
+
+        UINTN d = 0;
+        while (d < disk_registry.num_devices && disk_registry.devices[d].media_id != biop->Media->MediaId) 
+            d++;
+        if (d == disk_registry.num_devices) 
+            disk_registry.devices[disk_registry.num_devices++] = (Disk_Device){ 
+                .media_id = biop->Media->MediaId 
+            };
     }
 
-    if (!found) {
-        error(0, u"Could not find Block IO protocol for disk with ID %u.\r\n", disk_mediaID);
-        goto done;
+    // Group handles by device, with the entire disk first
+    //   NOTE: This assumes the first Block IO found with logical partition false is the entire disk
+    UINTN next_handle = 0;
+    for (UINTN d = 0; d < disk_registry.num_devices; d++) {
+        Disk_Device *device = &disk_registry.devices[d];
+        device->handles = &disk_registry.handles[next_handle];
+
+        for (UINTN pass = 0; pass < 2; pass++) {
+            for (UINTN i = 0; i < num_found; i++) {
+                EFI_BLOCK_IO_MEDIA *media = found[i].biop->Media;
+                if (media->MediaId != device->media_id) continue;
+
+                bool entire_disk = !media->LogicalPartition && !device->biop;
+                if (pass == 0 && entire_disk) {
+                    device->handle     = found[i].handle;
+                    device->biop       = found[i].biop;
+                    device->block_size = media->BlockSize;
+                    device->io_align   = media->IoAlign;
+                    if (device->biop->Revision >= EFI_BLOCK_IO_PROTOCOL_REVISION3)
+                        device->optimal_transfer_blocks = media->OptimalTransferLengthGranularity;
+
+                    bs->OpenProtocol(found[i].handle, 
+                                     &dio_guid,
+                                     (VOID **)&device->diop,
+                                     image,
+                                     NULL,
+                                     EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+
+                    // Async Disk IO is optional, reads fall back to Disk IO if not found
+                    bs->OpenProtocol(found[i].handle, 
+                                     &dio2_guid,
+                                     (VOID **)&device->diop2,
+                                     image,
+                                     NULL,
+                                     EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+                } else if (pass == 0 || found[i].handle == device->handle) {
+                    continue;   // Partitions are added after the entire disk
+                }
+
+                disk_registry.handles[next_handle++] = found[i];
+                device->num_handles++;
+            }
+        }
     }
+    disk_registry.num_handles = next_handle;
 
-    // Get Disk IO Protocol on same handle as Block IO protocol
-    EFI_GUID dio_guid = EFI_DISK_IO_PROTOCOL_GUID;
-    EFI_DISK_IO_PROTOCOL *diop;
-    status = bs->OpenProtocol(handle_buffer[i], 
-                              &dio_guid,
-                              (VOID **)&diop,
+    // Get media ID for this disk image from the loaded image's device handle
+    EFI_LOADED_IMAGE_PROTOCOL *lip = NULL;
+    status = bs->OpenProtocol(image,
+                              &lip_guid,
+                              (VOID **)&lip,
                               image,
                               NULL,
                               EFI_OPEN_PROTOCOL_GET_PROTOCOL);
     if (EFI_ERROR(status)) {
-        error(status, u"Could not Open Disk IO protocol on handle %u.\r\n", i);
-        goto done;
+        error(status, u"Could not open Loaded Image Protocol\r\n");
+        goto cleanup;
+    }
+
+    status = EFI_NOT_FOUND;
+    for (UINTN i = 0; i < disk_registry.num_handles; i++) {
+        if (disk_registry.handles[i].handle == lip->DeviceHandle) {
+            disk_registry.image_media_id = disk_registry.handles[i].biop->Media->MediaId;
+            status = EFI_SUCCESS;
+            break;
+        }
+    }
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not find Block IO Protocol for this loaded image.\r\n");
+        goto cleanup;
+    }
+
+    disk_registry.built = true;
+
+    cleanup:
+    if (handle_buffer) bs->FreePool(handle_buffer);
+    if (!disk_registry.built && disk_registry.devices) {
+        bs->FreePool(disk_registry.devices);
+        disk_registry = (Disk_Registry){0};
+    }
+    return status;
+}
+
+// =======================================================================
+// Forget the disk device registry, e.g. after connecting controllers 
+//   which can add new Block IO handles; it is rebuilt on next use.
+// =======================================================================
+void reset_disk_registry(void) {
+    for (UINTN i = 0; i < disk_registry.num_devices; i++) {
+        Disk_Device *device = &disk_registry.devices[i];
+        if (device->bounce) bs->FreePages(device->bounce_buffer, device->bounce_pages);
+    }
+
+    if (disk_registry.devices) bs->FreePool(disk_registry.devices);
+    disk_registry = (Disk_Registry){0};
+}
+
+// ============================================================
+// Get disk device from the registry for the input media ID
+//
+// Returns: Pointer to device in registry, or NULL if not found
+// ============================================================
+Disk_Device *find_disk_device(UINT32 media_id) {
+    if (!disk_registry.built && EFI_ERROR(build_disk_registry())) return NULL;
+
+    for (UINTN i = 0; i < disk_registry.num_devices; i++) 
+        if (disk_registry.devices[i].media_id == media_id) return &disk_registry.devices[i];
+
+    return NULL;
+}
+
+// ================================================
+// Get Media ID value for this running disk image
+// ================================================
+EFI_STATUS get_disk_image_mediaID(UINT32 *mediaID) {
+    EFI_STATUS status = build_disk_registry();
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not get Media ID for this loaded image.\r\n");
+        return status;
+    }
+
+    *mediaID = disk_registry.image_media_id;  // Media ID for this running disk image itself
+    return EFI_SUCCESS;
+}
+
+// ===========================================================
+// Get a timestamp counter value, for measuring elapsed ticks
+// ===========================================================
+extern UINT64 arch_read_timestamp(void);
+
+// ===========================================================
+// Record the end of a boot stage in the boot profile
+// ===========================================================
+void boot_stage(char *name) {
+    if (boot_profile.num_stages == MAX_BOOT_STAGES) return;
+    boot_profile.stages[boot_profile.num_stages++] = (Boot_Stage){ 
+        .name  = name, 
+        .ticks = arch_read_timestamp(),
+    };
+}
+
+// ===========================================================
+// Start the boot profile at loader entry, and calibrate the
+//   timestamp counter frequency in the background against a
+//   periodic timer event, so boot isn't held up measuring it.
+//   Timer notifications come on timer interrupts, so timestamps
+//   at the first and last one are whole timer periods apart.
+// ===========================================================
+#define BOOT_PROFILE_TIMER_PERIOD    100000  // 10ms, in 100ns units
+#define BOOT_PROFILE_CALIBRATE_TICKS 11      // Timer ticks to measure 10 periods (100ms) between
+#define BOOT_PROFILE_CALIBRATE_US    10000   // Stall() to calibrate with if boot was faster
+
+EFI_EVENT boot_profile_event = NULL;
+UINT64 boot_profile_first_tick = 0;     // Timestamps at first & latest timer notification
+UINT64 boot_profile_last_tick  = 0;
+UINT32 boot_profile_timer_ticks = 0;
+
+// Set ticks_per_second from timestamps timer_ticks notifications apart
+void boot_profile_calibrate(UINT64 first, UINT64 last, UINT32 timer_ticks) {
+    boot_profile.ticks_per_second = 
+        ((last - first) * (10000000 / BOOT_PROFILE_TIMER_PERIOD)) / (timer_ticks - 1);
+}
+
+VOID EFIAPI boot_profile_timer_tick(IN EFI_EVENT event, __attribute__((unused)) IN VOID *context) {
+    boot_profile_last_tick = arch_read_timestamp();
+    if (boot_profile_timer_ticks++ == 0) boot_profile_first_tick = boot_profile_last_tick;
+
+    if (boot_profile_timer_ticks == BOOT_PROFILE_CALIBRATE_TICKS) {
+        boot_profile_calibrate(boot_profile_first_tick, boot_profile_last_tick, 
+                               boot_profile_timer_ticks);
+        bs->SetTimer(event, TimerCancel, 0);
+    }
+}
+
+void boot_profile_start(void) {
+    boot_profile = (Boot_Profile){ .start = arch_read_timestamp() };
+
+    EFI_STATUS status = bs->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_NOTIFY, 
+                                        boot_profile_timer_tick, NULL, &boot_profile_event);
+    if (!EFI_ERROR(status)) 
+        status = bs->SetTimer(boot_profile_event, TimerPeriodic, BOOT_PROFILE_TIMER_PERIOD);
+    if (EFI_ERROR(status) && boot_profile_event) {
+        bs->CloseEvent(boot_profile_event);
+        boot_profile_event = NULL;
+    }
+}
+
+// ===========================================================
+// Stop calibrating the timestamp counter frequency, e.g. 
+//   before printing times or exiting boot services. Uses the 
+//   timer periods seen so far if calibration didn't finish, or
+//   a short Stall() if boot was too fast to see 2 of them.
+// ===========================================================
+void boot_profile_finish_calibration(void) {
+    if (boot_profile_event) {
+        bs->CloseEvent(boot_profile_event);   // No more notifications after this
+        boot_profile_event = NULL;
+    }
+    if (boot_profile.ticks_per_second) return;
+
+    if (boot_profile_timer_ticks >= 2) {
+        boot_profile_calibrate(boot_profile_first_tick, boot_profile_last_tick, 
+                               boot_profile_timer_ticks);
+        return;
+    }
+
+    UINT64 before = arch_read_timestamp();
+    bs->Stall(BOOT_PROFILE_CALIBRATE_US);
+    boot_profile.ticks_per_second = 
+        (arch_read_timestamp() - before) * (1000000 / BOOT_PROFILE_CALIBRATE_US);
+}
+
+// Convert timestamp ticks to microseconds, with the calibrated boot profile frequency
+UINT64 ticks_to_us(UINT64 ticks) {
+    if (boot_profile.ticks_per_second == 0) return 0;
+    return (ticks / boot_profile.ticks_per_second) * 1000000 + 
+           ((ticks % boot_profile.ticks_per_second) * 1000000) / boot_profile.ticks_per_second;
+}
+
+#define DISK_READ_CHUNK_SIZE (1024 * 1024)  // Target bytes per read call, before rounding
+
+// ===============================================================
+// Get bytes to read per call for a disk: a multiple of the 
+//   optimal transfer length granularity if the disk has one, 
+//   else of the block size.
+// ===============================================================
+UINTN disk_read_chunk_size(Disk_Device *device) {
+    UINTN granularity = device->block_size * max(device->optimal_transfer_blocks, 1);
+    return max(granularity, (DISK_READ_CHUNK_SIZE / granularity) * granularity);
+}
+
+// ===============================================================
+// Read size bytes at byte offset on a disk into buffer. Whole 
+//   blocks are read with Block IO straight into buffer when it is
+//   IoAlign aligned, in chunks sized to the disk's optimal 
+//   transfer length. Partial blocks or unaligned buffers go 
+//   through an aligned bounce buffer for the disk.
+// ===============================================================
+EFI_STATUS read_disk(Disk_Device *device, UINT64 offset, UINTN size, VOID *buffer) {
+    EFI_BLOCK_IO_PROTOCOL *biop = device->biop;
+    EFI_STATUS status = EFI_SUCCESS;
+    UINTN block_size = device->block_size;
+    UINTN chunk_size = disk_read_chunk_size(device);
+    UINTN align = device->io_align > 1 ? device->io_align : 1;  // IoAlign is a power of 2
+    UINT8 *dst = buffer;
+    UINT64 start = arch_read_timestamp();
+
+    while (size > 0) {
+        EFI_LBA lba = offset / block_size;
+        UINTN skip = offset % block_size;
+        UINTN len = 0;
+
+        if (skip == 0 && size >= block_size && ((UINTN)dst & (align-1)) == 0) {
+            // Whole blocks straight into caller's buffer
+            len = min(chunk_size, size - (size % block_size));
+            status = biop->ReadBlocks(biop, device->media_id, lba, len, dst);
+        } else {
+            if (!device->bounce) {
+                // Allocate bounce buffer once per disk, with extra pages to align if needed
+                UINTN pages = (chunk_size + align + (PAGE_SIZE-1)) / PAGE_SIZE;
+                status = bs->AllocatePages(AllocateAnyPages, 
+                                           EfiLoaderData, 
+                                           pages, 
+                                           &device->bounce_buffer);
+                if (EFI_ERROR(status)) {
+                    error(status, u"Could not allocate aligned bounce buffer for disk reads.\r\n");
+                    return status;
+                }
+                device->bounce_pages = pages;
+                device->bounce = (UINT8 *)((device->bounce_buffer + (align-1)) & ~(align-1));
+            }
+
+            // Blocks covering the start of the request into bounce buffer, then copy out
+            UINTN blocks_len = min(chunk_size, ((skip + size + (block_size-1)) / block_size) * block_size);
+            status = biop->ReadBlocks(biop, device->media_id, lba, blocks_len, device->bounce);
+            len = min(blocks_len - skip, size);
+            if (!EFI_ERROR(status)) memcpy(dst, device->bounce + skip, len);
+        }
+
+        if (EFI_ERROR(status)) {
+            error(status, u"Could not read disk %u at LBA %llu.\r\n", device->media_id, lba);
+            return status;
+        }
+
+        device->read_calls++;
+        device->bytes_read += len;
+        dst    += len;
+        offset += len;
+        size   -= len;
+    }
+
+    device->read_ticks += arch_read_timestamp() - start;
+    return EFI_SUCCESS;
+}
+
+// =================================================================
+// Read a file from a given disk (from input media ID), into an
+//   output buffer. 
+//
+// Returns: non-null pointer to allocated buffer with data, 
+//  allocated with Boot Services AllocatePages(), or NULL if not 
+//  found or error. If executable input parameter is true, then 
+//  allocate EfiLoaderCode memory type, else use EfiLoaderData.
+//
+//  NOTE: Caller will have to use FreePages() on returned buffer to 
+//    free allocated memory.
+// =================================================================
+EFI_PHYSICAL_ADDRESS 
+read_disk_lbas_to_buffer(EFI_LBA disk_lba, UINTN data_size, UINT32 disk_mediaID, bool executable) {
+    EFI_PHYSICAL_ADDRESS buffer = 0;
+    EFI_STATUS status = EFI_SUCCESS;
+
+    Disk_Device *device = find_disk_device(disk_mediaID);
+    if (!device || !device->biop) {
+        error(EFI_NOT_FOUND, u"Could not find Block IO protocol for disk with ID %u.\r\n", disk_mediaID);
+        return 0;
     }
 
     // Allocate buffer for data
@@ -1825,17 +2456,14 @@ read_disk_lbas_to_buffer(EFI_LBA disk_lba, UINTN data_size, UINT32 disk_mediaID,
                                &buffer);
     if (EFI_ERROR(status)) {
         error(status, u"Could not Allocate buffer for disk data.\r\n");
-        goto done;
+        return 0;
     }
 
-    // Use Disk IO Read to read into allocated buffer
-    status = diop->ReadDisk(diop, disk_mediaID, disk_lba * biop->Media->BlockSize, data_size, (VOID *)buffer);
+    // Read into allocated buffer
+    status = read_disk(device, disk_lba * device->block_size, data_size, (VOID *)buffer);
     if (EFI_ERROR(status)) 
         error(status, u"Could not read Disk LBAs into buffer.\r\n");
 
-    done:
-    if (handle_buffer) bs->FreePool(handle_buffer);   // Free allocated handle buffer
-
     return buffer;
 }
 
@@ -2018,65 +2646,274 @@ EFI_STATUS check_gop_mode(UINT32 *ret_mode, UINT32 xres, UINT32 yres) {
     return status;
 }
 
-// ================================================
-// Get Media ID value for this running disk image
-// ================================================
-EFI_STATUS get_disk_image_mediaID(UINT32 *mediaID) {
-    EFI_STATUS status = EFI_SUCCESS;
+// ================================================================
+// Check if a fully qualified file path exists in the EFI System 
+//   Partition, without printing errors if it does not.
+// ================================================================
+bool esp_file_exists(CHAR16 *path) {
+    EFI_FILE_PROTOCOL *root = esp_root_dir(), *file = NULL;
+    if (!root) return false;
 
-    // Get media ID for this disk image 
-    EFI_GUID lip_guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
-    EFI_LOADED_IMAGE_PROTOCOL *lip = NULL;
-    status = bs->OpenProtocol(image,
-                              &lip_guid,
-                              (VOID **)&lip,
-                              image,
-                              NULL,
-                              EFI_OPEN_PROTOCOL_GET_PROTOCOL);
-    if (EFI_ERROR(status)) {
-        error(status, u"Could not open Loaded Image Protocol\r\n");
-        goto done;
-    }
+    bool exists = !EFI_ERROR(root->Open(root, &file, path, EFI_FILE_MODE_READ, 0));
+    if (file) file->Close(file);
+    root->Close(root);
+    return exists;
+}
 
-    // Get Block IO protocol for loaded image's device handle
-    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
-    EFI_BLOCK_IO_PROTOCOL *biop = NULL;
-    status = bs->OpenProtocol(lip->DeviceHandle,
-                              &bio_guid,
-                              (VOID **)&biop,
-                              image,
-                              NULL,
-                              EFI_OPEN_PROTOCOL_GET_PROTOCOL);
-    if (EFI_ERROR(status)) {
-        error(status, u"Could not open Block IO Protocol for this loaded image.\r\n");
-        goto done;
+// =============================================
+// FNV-1a hash of a file name for index lookups
+// =============================================
+UINT32 data_index_hash(char *name) {
+    UINT32 hash = 2166136261u;
+    while (*name) {
+        hash ^= (UINT8)*name++;
+        hash *= 16777619u;
     }
+    return hash;
+}
+
+// =================================================================
+// Check if a file name matches a name to look up, either the full 
+//   name or the name without the extension.
+// =================================================================
+bool file_name_matches(char *file_name, char *name) {
+    UINTN len = strlen(name);
+    return !memcmp(file_name, name, len) && 
+           (file_name[len] == '\0' || file_name[len] == '.');
+}
 
-    *mediaID = biop->Media->MediaId;  // Media ID for this running disk image itself
+// =================================================================
+// Add a name for an index entry to the data partition hash table.
+//   Names already in the table are not replaced, so the first 
+//   file found for a name wins.
+// =================================================================
+void data_index_insert(char *name, UINTN entry) {
+    UINTN mask = data_index.num_slots - 1;
+    for (UINTN slot = data_index_hash(name) & mask; ; slot = (slot + 1) & mask) {
+        if (!data_index.slots[slot]) {
+            data_index.slots[slot] = entry + 1;
+            return;
+        }
+        if (file_name_matches(data_index.entries[data_index.slots[slot]-1].name, name)) 
+            return; 
+    }
+}
 
-    done:
-    return status;
+// ==================================================================
+// Insert a name for an index entry, given as a length limited string
+//   e.g. a file name without its extension. 
+// ==================================================================
+void data_index_insert_n(char *name, UINTN len, UINTN entry) {
+    char buf[DATA_FILE_NAME_LEN];
+    if (len >= sizeof buf) len = sizeof buf - 1;
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    data_index_insert(buf, entry);
 }
 
-// ===============================================================
-// Read a file in the GPT disk image's raw data partition,
-//   using information found in the FILE.TXT file in the ESP,
-//   created when making the disk image.
+// ========================================================================
+// Parse FILE.TXT text manifest into entries array. Entries are lines of
+//   "KEY=VALUE", where FILE_NAME= (or a line without '=') starts a new 
+//   file, followed by FILE_SIZE=, DISK_LBA= and optionally CHECKSUM=<hex>.
+//   If entries is NULL, only count the number of files.
 //
-// Returns: 
-//  - non-null pointer to allocated buffer with file data, 
-//      allocated with Boot Services AllocatePool(), or NULL if not 
-//      found or error.
-//  - Size of returned buffer, if not NULL.
+// Returns: number of files found
+// ========================================================================
+UINTN parse_file_txt(char *text, UINTN text_size, Data_File_Entry *entries) {
+    UINTN count = 0;
+    Data_File_Entry *entry = NULL;
+
+    char *end = text + text_size;
+    for (char *line = text; line < end; ) {
+        // Get next line, without line ending characters
+        char *eol = line;
+        while (eol < end && *eol != '\r' && *eol != '\n' && *eol != '\0') eol++;
+        UINTN len = eol - line;
+
+        // Find '=' for "KEY=VALUE" lines
+        char *equals = line;
+        while (equals < eol && *equals != '=') equals++;
+        char *value = equals + 1;
+        UINTN key_len = equals - line;
+
+        bool new_file = false;
+        char *name = line;
+        UINTN name_len = len;
+        if (len > 0 && equals == eol) new_file = true;     // Bare file name line
+        else if (key_len == 9 && !memcmp(line, "FILE_NAME", 9)) {
+            new_file = true;
+            name = value;
+            name_len = eol - value;
+        }
+
+        if (new_file) {
+            entry = entries ? &entries[count] : NULL;
+            count++;
+            if (entry) {
+                memset(entry, 0, sizeof *entry);
+                if (name_len >= DATA_FILE_NAME_LEN) name_len = DATA_FILE_NAME_LEN-1;
+                memcpy(entry->name, name, name_len);
+            }
+        } else if (entry && equals < eol) {
+            // Values for current file. NOTE: atoi/xtoi stop at the end of line characters
+            if (key_len == 9 && !memcmp(line, "FILE_SIZE", 9)) 
+                entry->size = atoi(value);
+            else if (key_len == 8 && !memcmp(line, "DISK_LBA", 8)) 
+                entry->disk_lba = atoi(value);
+            else if (key_len == 8 && !memcmp(line, "CHECKSUM", 8)) {
+                entry->checksum = xtoi(value);
+                entry->has_checksum = true;
+            }
+        }
+
+        if (entries && key_len == 9 && equals < eol && !memcmp(line, "DISK_SIZE", 9))
+            data_index.disk_size = atoi(value);
+
+        // Go to start of next line
+        line = eol;
+        while (line < end && (*line == '\r' || *line == '\n' || *line == '\0')) line++;
+    }
+
+    return count;
+}
+
+// =====================================================================
+// Build the data partition file index from FILE.BIN, the binary 
+//   manifest, if it exists in the ESP, else from the FILE.TXT file
+//   created when making the disk image. The manifest is only opened and
+//   parsed once per boot; later lookups only use the built index.
+// =====================================================================
+EFI_STATUS build_data_partition_index(void) {
+    EFI_STATUS status = EFI_SUCCESS;
+    VOID *manifest = NULL;
+    UINTN manifest_size = 0;
+
+    if (data_index.built) return EFI_SUCCESS;
+
+    CHAR16 *bin_name = u"\\EFI\\BOOT\\FILE.BIN";
+    CHAR16 *txt_name = u"\\EFI\\BOOT\\FILE.TXT";
+    bool binary = esp_file_exists(bin_name);
+    CHAR16 *file_name = binary ? bin_name : txt_name;
+
+    manifest = read_esp_file_to_buffer(file_name, &manifest_size);
+    if (!manifest) {
+        status = EFI_NOT_FOUND;
+        error(status, u"Could not find or read file '%s' to buffer\r\n", file_name);
+        goto cleanup;
+    }
+
+    // Get number of files to allocate the index
+    Data_Manifest_Header *bin_hdr = manifest;
+    UINTN num_entries = 0;
+    if (binary) {
+        if (manifest_size < sizeof *bin_hdr || bin_hdr->magic != DATA_MANIFEST_MAGIC ||
+            bin_hdr->entry_size < sizeof(Data_Manifest_Entry) ||
+            manifest_size < sizeof *bin_hdr + ((UINTN)bin_hdr->num_entries * bin_hdr->entry_size)) {
+            status = EFI_CRC_ERROR;
+            error(status, u"Invalid binary file manifest '%s'\r\n", file_name);
+            goto cleanup;
+        }
+        num_entries = bin_hdr->num_entries;
+    } else {
+        num_entries = parse_file_txt(manifest, manifest_size, NULL);
+    }
+
+    // Hash slots hold UINT16 entry index + 1
+    if (num_entries >= UINT16_MAX) {
+        status = EFI_UNSUPPORTED;
+        error(status, u"Too many files in manifest '%s': %llu, max %llu\r\n", 
+              file_name, (UINT64)num_entries, (UINT64)UINT16_MAX - 1);
+        goto cleanup;
+    }
+
+    // Hash table has room for each file name and name without extension, at most half full
+    UINTN num_slots = 16;
+    while (num_slots < num_entries * 4) num_slots *= 2;
+
+    status = bs->AllocatePool(EfiLoaderData, 
+                              (num_entries * sizeof *data_index.entries) + 
+                              (num_slots * sizeof *data_index.slots), 
+                              (VOID **)&data_index.entries);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not allocate data partition file index\r\n");
+        goto cleanup;
+    }
+
+    data_index.num_entries = num_entries;
+    data_index.num_slots   = num_slots;
+    data_index.slots       = (UINT16 *)(data_index.entries + num_entries);
+    memset(data_index.slots, 0, num_slots * sizeof *data_index.slots);
+
+    // Fill out entries
+    if (binary) {
+        data_index.disk_size = bin_hdr->disk_size;
+        for (UINTN i = 0; i < num_entries; i++) {
+            Data_Manifest_Entry *bin_entry = 
+                (Data_Manifest_Entry *)((UINT8 *)(bin_hdr + 1) + (i * bin_hdr->entry_size));
+
+            data_index.entries[i] = (Data_File_Entry){
+                .disk_lba     = bin_entry->disk_lba,
+                .size         = bin_entry->size,
+                .checksum     = bin_entry->checksum,
+                .has_checksum = bin_entry->flags & DATA_MANIFEST_HAS_CHECKSUM,
+            };
+            memcpy(data_index.entries[i].name, bin_entry->name, DATA_FILE_NAME_LEN-1);
+        }
+    } else {
+        parse_file_txt(manifest, manifest_size, data_index.entries);
+    }
+
+    // Add full names first, so they win over names without extensions e.g. "kernel"
+    for (UINTN i = 0; i < num_entries; i++) 
+        data_index_insert(data_index.entries[i].name, i);
+
+    for (UINTN i = 0; i < num_entries; i++) {
+        char *name = data_index.entries[i].name;
+        UINTN len = 0;
+        while (name[len] && name[len] != '.') len++;
+        if (name[len] == '.') data_index_insert_n(name, len, i);
+    }
+
+    data_index.built = true;
+
+    cleanup:
+    if (manifest) bs->FreePool(manifest);
+    return status;
+}
+
+// ====================================================================
+// Find a file in the data partition by its full name e.g. 
+//   "ter-132n.psf", or name without the extension e.g. "kernel".
+//   Builds the data partition file index on first use.
 //
-//  NOTE: Caller will have to use FreePool() on returned buffer to 
-//    free allocated memory.
+// Returns: Pointer to file info in the index, or NULL if not found
+// ====================================================================
+Data_File_Entry *find_data_partition_file(char *name) {
+    if (!data_index.built && EFI_ERROR(build_data_partition_index())) return NULL;
+
+    UINTN mask = data_index.num_slots - 1;
+    for (UINTN slot = data_index_hash(name) & mask; 
+         data_index.slots[slot]; 
+         slot = (slot + 1) & mask) {
+
+        Data_File_Entry *entry = &data_index.entries[data_index.slots[slot]-1];
+        if (file_name_matches(entry->name, name)) return entry; 
+    }
+
+    return NULL;
+}
+
 // ===============================================================
-VOID *read_data_partition_file_to_buffer(char *in_name, bool executable, UINTN *ret_size) {
-    VOID *esp_file = NULL;
-    VOID *data_file = NULL;
+// Open a file in the GPT disk image's raw data partition,
+//   using information found in the data partition file index
+//   built from the ESP file manifest. No file data is read;
+//   use read_data_file() to read any part of the file from disk.
+// ===============================================================
+EFI_STATUS open_data_partition_file(char *in_name, Data_File *file) {
     EFI_STATUS status = EFI_SUCCESS;
 
+    memset(file, 0, sizeof *file);
+
     // Get media ID (disk number for Block IO protocol Media) for this running disk image
     UINT32 image_mediaID = 0;
     status = get_disk_image_mediaID(&image_mediaID);
@@ -2085,49 +2922,736 @@ VOID *read_data_partition_file_to_buffer(char *in_name, bool executable, UINTN *
         goto cleanup;
     }
 
-    // Get FILE.TXT file from path "/EFI/BOOT/FILE.TXT"
-    CHAR16 *file_name = u"\\EFI\\BOOT\\FILE.TXT";
-    UINTN buf_size = 0;
-    esp_file = read_esp_file_to_buffer(file_name, &buf_size);
-    if (!esp_file) {
-        error(0, u"Could not find or read file '%s' to buffer\r\n", file_name);
+    // Get disk LBA and file size from data partition file index for input file name 
+    Data_File_Entry *entry = find_data_partition_file(in_name);
+    if (!entry) {
+        status = EFI_NOT_FOUND;
+        error(status, u"Could not find file '%hhs' in data partition\r\n", in_name);
         goto cleanup;
     }
 
-    // Get disk LBA and file size from FILE.TXT for input file name 
-    char *str_pos = stpstr(esp_file, in_name);
-    if (!str_pos) {
-        error(0, u"Could not find file '%s' in data partition\r\n", in_name);
+    // Get disk image device to read the file with later
+    file->device = find_disk_device(image_mediaID);
+    if (!file->device || !file->device->biop) {
+        status = EFI_NOT_FOUND;
+        error(status, u"Could not find Block IO protocol for disk image.\r\n");
         goto cleanup;
     }
 
-    str_pos = stpstr(str_pos, "FILE_SIZE=");
-    if (!str_pos) {
-        error(0, u"Could not find file size for '%s'\r\n", in_name);
-        goto cleanup;
+    file->disk_offset  = entry->disk_lba * file->device->block_size;
+    file->size         = entry->size;
+    file->verify       = entry->has_checksum;
+    file->expected_crc = entry->checksum;
+    file->crc          = 0xFFFFFFFF;
+
+    cleanup:
+    return status;
+}
+
+// ===============================================================
+// Update a running CRC32C (Castagnoli) value with more data, using
+//   a lookup table built on first use. Start with 0xFFFFFFFF and 
+//   invert the final value.
+// ===============================================================
+UINT32 crc32c_table[256] = {0};
+
+UINT32 crc32c_update(UINT32 crc, VOID *buffer, UINTN len) {
+    if (!crc32c_table[1]) {
+        for (UINT32 i = 0; i < 256; i++) {
+            UINT32 value = i;
+            for (UINTN bit = 0; bit < 8; bit++) 
+                value = (value >> 1) ^ (0x82F63B78 & -(value & 1));     // Reversed polynomial
+            crc32c_table[i] = value;
+        }
     }
 
-    UINTN file_size = atoi(str_pos);
+    for (UINT8 *p = buffer; len > 0; len--, p++)
+        crc = crc32c_table[(crc ^ *p) & 0xFF] ^ (crc >> 8);
 
-    str_pos = stpstr(str_pos, "DISK_LBA=");
-    if (!str_pos) {
-        error(0, u"Could not find disk lba value for '%s'\r\n", in_name);
-        goto cleanup;
+    return crc;
+}
+
+// ===============================================================
+// Update a running CRC32C value, using CPU CRC instructions if 
+//   available
+// ===============================================================
+extern UINT32 arch_crc32c(UINT32 crc, VOID *buffer, UINTN len);
+
+// ======================================================================
+// Get the pixels of one glyph line as bits, with the leftmost pixel in
+//   bit width-1. Fonts storing pixels left to right e.g. PSF are read big 
+//   endian, with padding in the low bits of the last byte; others are read
+//   little endian. Only this line's bytes are read, so fonts up to 64 
+//   pixels wide work without padding after the glyph data.
+// ======================================================================
+uint64_t glyph_line_bits(Bitmap_Font *font, uint8_t *line) {
+    uint32_t line_bytes = (font->width + 7) / 8;
+    uint64_t bits = 0;
+    if (font->left_col_first) {
+        for (uint32_t i = 0; i < line_bytes; i++) bits = (bits << 8) | line[i];
+        return bits >> ((line_bytes * 8) - font->width);
+    }
+
+    for (uint32_t i = 0; i < line_bytes; i++) bits |= (uint64_t)line[i] << (i * 8);
+    return bits;
+}
+
+// ======================================================================
+// Expand a bitmap font glyph to ARGB pixels in fg/bg colors, into rows
+//   pitch pixels apart; a pixel at a time, selecting colors without 
+//   branches. arch_expand_glyph() is the same with SIMD if available.
+// ======================================================================
+void expand_glyph(uint32_t *dst, uint32_t pitch, Bitmap_Font *font, uint8_t *glyph, 
+                  uint32_t fg, uint32_t bg) {
+    const uint32_t line_bytes = (font->width + 7) / 8;
+    for (uint32_t i = 0; i < font->height; i++, dst += pitch, glyph += line_bytes) {
+        uint64_t bits = glyph_line_bits(font, glyph);
+        for (uint32_t px = 0; px < font->width; px++)
+            dst[px] = bg ^ ((fg ^ bg) & -(uint32_t)((bits >> (font->width-1 - px)) & 1));
+    }
+}
+
+// ===============================================================
+// Add data read from an opened data partition file to its running
+//   checksum. Synchronous reads are checksummed right after the 
+//   read, while the data is likely still in cache; async reads are
+//   checksummed when waited on, a second pass over memory the disk
+//   wrote to. The checksum covers the file in order, so data not 
+//   read yet before offset is read from disk and checksummed 
+//   first; data already checksummed is skipped.
+// ===============================================================
+EFI_STATUS checksum_data_file(Data_File *file, UINT64 offset, UINTN size, VOID *buffer) {
+    if (!file->verify || offset + size <= file->crc_offset) return EFI_SUCCESS;
+
+    // Checksum any gap since the last data checksummed, e.g. headers or padding that are not
+    //   loaded
+    UINT8 gap[PAGE_SIZE];
+    while (file->crc_offset < offset) {
+        UINTN len = min(sizeof gap, offset - file->crc_offset);
+        EFI_STATUS status = read_disk(file->device, file->disk_offset + file->crc_offset, len, gap);
+        if (EFI_ERROR(status)) {
+            error(status, u"Could not read file data at offset %llu to checksum.\r\n", 
+                  file->crc_offset);
+            return status;
+        }
+
+        file->crc = arch_crc32c(file->crc, gap, len);
+        file->crc_offset += len;
+    }
+
+    UINTN skip = file->crc_offset - offset;
+    file->crc = arch_crc32c(file->crc, (UINT8 *)buffer + skip, size - skip);
+    file->crc_offset += size - skip;
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS read_lz4_data_file(Data_File *file, UINT64 offset, UINTN size, VOID *buffer);
+
+// ===============================================================
+// Read size bytes at byte offset in an opened data partition 
+//   file directly from disk into buffer. Compressed files are
+//   decompressed on the fly.
+// ===============================================================
+EFI_STATUS read_data_file(Data_File *file, UINT64 offset, UINTN size, VOID *buffer) {
+    if (offset > file->size || size > file->size - offset) {
+        error(EFI_INVALID_PARAMETER, u"Read of %u bytes at offset %llu is past end of file.\r\n", 
+              size, offset);
+        return EFI_INVALID_PARAMETER;
+    }
+    if (size == 0) return EFI_SUCCESS;
+    if (file->lz4) return read_lz4_data_file(file, offset, size, buffer);
+    if (file->memory) {
+        memcpy(buffer, file->memory + offset, size);
+        return EFI_SUCCESS;
+    }
+
+    EFI_STATUS status = read_disk(file->device, file->disk_offset + offset, size, buffer);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not read %u bytes at file offset %llu from disk.\r\n", size, offset);
+        return status;
+    }
+
+    return checksum_data_file(file, offset, size, buffer);
+}
+
+// ===============================================================
+// Start reading size bytes at byte offset in an opened data 
+//   partition file into buffer, without waiting for the read to
+//   finish. Uses Disk IO 2 if the disk supports it; otherwise, or
+//   if reads is full, the read is done synchronously with Disk IO.
+//
+// NOTE: buffer must not be used or freed until after calling
+//   wait_data_file_reads() on the same reads batch.
+// ===============================================================
+EFI_STATUS read_data_file_async(Data_File *file, UINT64 offset, UINTN size, VOID *buffer, 
+                                Data_File_Reads *reads) {
+    // Compressed files already overlap reading & decompressing
+    if (file->memory || file->lz4 || !file->device->diop2 || 
+        reads->count == MAX_DATA_FILE_READS || size == 0)
+        return read_data_file(file, offset, size, buffer);
+
+    EFI_DISK_IO2_PROTOCOL *diop2 = file->device->diop2;
+
+    if (offset > file->size || size > file->size - offset) {
+        error(EFI_INVALID_PARAMETER, u"Read of %u bytes at offset %llu is past end of file.\r\n", 
+              size, offset);
+        return EFI_INVALID_PARAMETER;
+    }
+
+    // Token event is signaled by the firmware when the read completes
+    EFI_DISK_IO2_TOKEN *token = &reads->tokens[reads->count];
+    *token = (EFI_DISK_IO2_TOKEN){0};
+    EFI_STATUS status = bs->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &token->Event);
+    if (EFI_ERROR(status)) return read_data_file(file, offset, size, buffer);
+
+    status = diop2->ReadDiskEx(diop2, 
+                               file->device->media_id, 
+                               file->disk_offset + offset, 
+                               token,
+                               size, 
+                               buffer);
+    if (EFI_ERROR(status)) {
+        bs->CloseEvent(token->Event);
+        return read_data_file(file, offset, size, buffer);
+    }
+
+    reads->pending[reads->count].file   = file;
+    reads->pending[reads->count].offset = offset;
+    reads->pending[reads->count].size   = size;
+    reads->pending[reads->count].buffer = buffer;
+    reads->count++;
+    return EFI_SUCCESS;
+}
+
+// ===============================================================
+// Wait for all pending reads in a batch to finish, and reset the
+//   batch to be used again.
+//
+// Returns: First error status found for any read in the batch
+// ===============================================================
+EFI_STATUS wait_data_file_reads(Data_File_Reads *reads) {
+    for (UINTN i = 0; i < reads->count; i++) {
+        EFI_DISK_IO2_TOKEN *token = &reads->tokens[i];
+        UINTN index = 0;
+        EFI_STATUS status = bs->WaitForEvent(1, &token->Event, &index);
+        if (!EFI_ERROR(status)) status = token->TransactionStatus;
+        bs->CloseEvent(token->Event);
+
+        if (!EFI_ERROR(status)) {
+            status = checksum_data_file(reads->pending[i].file, 
+                                        reads->pending[i].offset, 
+                                        reads->pending[i].size, 
+                                        reads->pending[i].buffer);
+        } else {
+            error(status, u"Asynchronous disk read %u failed.\r\n", i);
+        }
+
+        if (EFI_ERROR(status) && !EFI_ERROR(reads->status)) reads->status = status;
+    }
+
+    EFI_STATUS status = reads->status;
+    *reads = (Data_File_Reads){0};
+    return status;
+}
+
+// ===============================================================
+// Decompress one LZ4 block (raw LZ4 sequences, no frame header) 
+//   from src into dst, without writing past dst_size bytes.
+//
+// Returns: Number of bytes decompressed, or -1 if the block is
+//   malformed or does not fit in dst.
+// ===============================================================
+INTN lz4_decompress_block(UINT8 *src, UINTN src_size, UINT8 *dst, UINTN dst_size) {
+    UINT8 *ip = src,  *ip_end = src + src_size;
+    UINT8 *op = dst,  *op_end = dst + dst_size;
+
+    while (ip < ip_end) {
+        // Token: high 4 bits literal length, low 4 bits match length - 4
+        UINT8 token = *ip++;
+
+        UINTN len = token >> 4;
+        if (len == 15) {
+            UINT8 b = 0;
+            do {
+                if (ip >= ip_end) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+
+        if (len > (UINTN)(ip_end - ip) || len > (UINTN)(op_end - op)) return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        if (ip == ip_end) break;    // Last sequence only has literals
+
+        // Match: offset back into output so far, and length
+        if (ip_end - ip < 2) return -1;
+        UINTN offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (UINTN)(op - dst)) return -1;
+
+        len = token & 0x0F;
+        if (len == 15) {
+            UINT8 b = 0;
+            do {
+                if (ip >= ip_end) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += 4;   // Minimum match length
+
+        if (len > (UINTN)(op_end - op)) return -1;
+        UINT8 *match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            // Overlapping match repeats the last offset bytes
+            while (len--) *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
+
+// ===============================================================
+// Start reading the next LZ4 block's data, its checksum if any,
+//   and the header of the block after it, into the next 
+//   compressed block buffer.
+// ===============================================================
+EFI_STATUS lz4_start_block_read(LZ4_Stream *lz) {
+    if (lz->next_block == 0) return EFI_SUCCESS;    // End mark, nothing left to read
+
+    UINTN data_size = lz->next_block & ~LZ4_BLOCK_UNCOMPRESSED;
+    if (data_size > lz->max_block_size) {
+        error(EFI_VOLUME_CORRUPTED, u"LZ4 block size %u is larger than max block size.\r\n", data_size);
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    UINT64 start = arch_read_timestamp();
+    EFI_STATUS status = read_data_file_async(&lz->raw, 
+                                             lz->next_block_offset, 
+                                             data_size + (lz->block_checksum ? 4 : 0) + 4,
+                                             lz->in[lz->in_index], 
+                                             &lz->reads);
+    lz->read_ticks += arch_read_timestamp() - start;
+    return status;
+}
+
+// ===============================================================
+// Restart an LZ4 stream from the first block, for reads before
+//   the current position in the stream.
+// ===============================================================
+EFI_STATUS lz4_restart(LZ4_Stream *lz) {
+    wait_data_file_reads(&lz->reads);
+
+    lz->next_block_offset = lz->first_block + 4;
+    lz->out_offset = 0;
+    lz->block_len  = 0;
+    lz->in_index   = 0;
+
+    EFI_STATUS status = read_data_file(&lz->raw, lz->first_block, 4, &lz->next_block);
+    if (EFI_ERROR(status)) return status;
+
+    return lz4_start_block_read(lz);
+}
+
+// ===============================================================
+// Decompress the next LZ4 block into dst, and start reading the
+//   block after it.
+// ===============================================================
+EFI_STATUS lz4_next_block(LZ4_Stream *lz, UINT8 *dst, UINTN dst_size, UINTN *out_len) {
+    if (lz->next_block == 0) {
+        error(EFI_VOLUME_CORRUPTED, u"LZ4 frame ended before its content size.\r\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    UINT64 start = arch_read_timestamp();
+    EFI_STATUS status = wait_data_file_reads(&lz->reads);
+    lz->read_ticks += arch_read_timestamp() - start;
+    if (EFI_ERROR(status)) return status;
+
+    // Get this block's buffer and size, and the header for the next block after its data
+    UINT8 *src = lz->in[lz->in_index];
+    UINT32 hdr = lz->next_block;
+    UINTN src_size = hdr & ~LZ4_BLOCK_UNCOMPRESSED;
+    UINTN skip = src_size + (lz->block_checksum ? 4 : 0);
+
+    memcpy(&lz->next_block, src + skip, 4);
+    lz->next_block_offset += skip + 4;
+
+    // Read next block while this one is decompressed
+    lz->in_index ^= 1;
+    status = lz4_start_block_read(lz);
+    if (EFI_ERROR(status)) return status;
+
+    start = arch_read_timestamp();
+    INTN len = -1;
+    if (hdr & LZ4_BLOCK_UNCOMPRESSED) {
+        if (src_size <= dst_size) {
+            memcpy(dst, src, src_size);
+            len = src_size;
+        }
+    } else {
+        len = lz4_decompress_block(src, src_size, dst, dst_size);
+    }
+    lz->decompress_ticks += arch_read_timestamp() - start;
+
+    if (len <= 0) {
+        error(EFI_VOLUME_CORRUPTED, u"Could not decompress LZ4 block at offset %llu.\r\n", 
+              lz->out_offset);
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    lz->out_offset += len;
+    *out_len = len;
+    return EFI_SUCCESS;
+}
+
+// ===============================================================
+// Read size bytes at decompressed byte offset in an opened LZ4 
+//   compressed data partition file into buffer. Whole blocks are
+//   decompressed straight into buffer; partial blocks go through
+//   the stream's block buffer. Reading forward is cheapest, 
+//   reading before the last block restarts the stream.
+// ===============================================================
+EFI_STATUS read_lz4_data_file(Data_File *file, UINT64 offset, UINTN size, VOID *buffer) {
+    LZ4_Stream *lz = file->lz4;
+    UINT8 *dst = buffer;
+    EFI_STATUS status = EFI_SUCCESS;
+
+    while (size > 0) {
+        // Copy from last decompressed block if it has the data
+        if (lz->block_len && offset >= lz->block_offset && offset < lz->block_offset + lz->block_len) {
+            UINTN len = min(size, lz->block_offset + lz->block_len - offset);
+            memcpy(dst, lz->block + (offset - lz->block_offset), len);
+            dst += len;
+            offset += len;
+            size -= len;
+            continue;
+        }
+
+        if (offset < lz->out_offset) {
+            status = lz4_restart(lz);
+            if (EFI_ERROR(status)) return status;
+            continue;
+        }
+
+        UINTN len = 0;
+        if (offset == lz->out_offset && size >= lz->max_block_size) {
+            // Whole block fits in caller's buffer
+            status = lz4_next_block(lz, dst, size, &len);
+            if (EFI_ERROR(status)) return status;
+
+            dst += len;
+            offset += len;
+            size -= len;
+        } else {
+            // Partial block, or skipping data before offset
+            lz->block_offset = lz->out_offset;
+            lz->block_len = 0;
+            status = lz4_next_block(lz, lz->block, lz->max_block_size, &len);
+            if (EFI_ERROR(status)) return status;
+
+            lz->block_len = len;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+// ===============================================================
+// Check if an opened data partition file is an LZ4 frame, and if
+//   so set it up to be decompressed on the fly when read. The 
+//   frame must have independent blocks and a content size.
+//   Files that are not compressed are left as is.
+//
+// NOTE: Caller should use close_data_file() when done reading.
+// ===============================================================
+EFI_STATUS open_lz4_data_file(Data_File *file) {
+    UINT8 hdr[LZ4_FRAME_MAX_HEADER_SIZE] = {0};
+    if (file->size < 7 || file->lz4) return EFI_SUCCESS;    // Too small for magic, FLG, BD, HC
+
+    EFI_STATUS status = read_data_file(file, 0, min(file->size, sizeof hdr), hdr);
+    if (EFI_ERROR(status)) return status;
+
+    UINT32 magic = 0;
+    memcpy(&magic, hdr, 4);
+    if (magic != LZ4_FRAME_MAGIC) return EFI_SUCCESS;
+
+    UINT8 flg = hdr[4], bd = hdr[5];
+    UINTN block_size_id = (bd >> 4) & 0x07;
+    if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION || block_size_id < 4) {
+        error(EFI_UNSUPPORTED, u"Unsupported LZ4 frame version or block size.\r\n");
+        return EFI_UNSUPPORTED;
+    }
+
+    // Blocks are decompressed out of order into different buffers, can't reference each other;
+    //   content size is needed to allocate memory for loading the file
+    if (!(flg & LZ4_FLG_BLOCK_INDEPENDENT) || !(flg & LZ4_FLG_CONTENT_SIZE)) {
+        error(EFI_UNSUPPORTED, u"LZ4 frame needs independent blocks and content size, e.g. "
+                               u"'lz4 --content-size'.\r\n");
+        return EFI_UNSUPPORTED;
+    }
+
+    UINT64 content_size = 0;
+    memcpy(&content_size, hdr + 6, 8);
+    UINT64 first_block = 6 + 8 + ((flg & LZ4_FLG_DICT_ID) ? 4 : 0) + 1;
+
+    // Max block size: 4 = 64KiB, 5 = 256KiB, 6 = 1MiB, 7 = 4MiB
+    UINTN max_block_size = 1ULL << (8 + (2 * block_size_id));
+    UINTN in_size = max_block_size + 8;     // Block checksum & next block header
+
+    LZ4_Stream *lz = NULL;
+    status = bs->AllocatePool(EfiLoaderData, 
+                              sizeof *lz + max_block_size + (2 * in_size),
+                              (VOID **)&lz);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not allocate buffers for LZ4 decompression.\r\n");
+        return status;
+    }
+
+    *lz = (LZ4_Stream){
+        .raw            = *file,
+        .first_block    = first_block,
+        .max_block_size = max_block_size,
+        .block_checksum = flg & LZ4_FLG_BLOCK_CHECKSUM,
+        .block          = (UINT8 *)(lz + 1),
+    };
+    lz->in[0] = lz->block + max_block_size;
+    lz->in[1] = lz->in[0] + in_size;
+
+    status = lz4_restart(lz);
+    if (EFI_ERROR(status)) {
+        wait_data_file_reads(&lz->reads);
+        bs->FreePool(lz);
+        return status;
+    }
+
+    // Compressed data is checksummed as it is read, not the decompressed data
+    file->lz4    = lz;
+    file->size   = content_size;
+    file->verify = false;
+    return EFI_SUCCESS;
+}
+
+// ===============================================================
+// Check an opened data partition file's checksum against the 
+//   manifest, after all the data needed from it has been read. 
+//   Any file data that was not read is read now to checksum it.
+//
+// Returns: EFI_CRC_ERROR if the checksum does not match
+// ===============================================================
+EFI_STATUS verify_data_file(Data_File *file) {
+    if (file->lz4) {
+        wait_data_file_reads(&file->lz4->reads);  // Next block may still be read ahead
+        file = &file->lz4->raw;
+    }
+    if (!file->verify) return EFI_SUCCESS;
+
+    EFI_STATUS status = checksum_data_file(file, file->size, 0, NULL);
+    if (EFI_ERROR(status)) return status;
+
+    UINT32 crc = file->crc ^ 0xFFFFFFFF;
+    if (crc != file->expected_crc) {
+        error(EFI_CRC_ERROR, u"File checksum %x does not match manifest checksum %x.\r\n", 
+              crc, file->expected_crc);
+        return EFI_CRC_ERROR;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// ===============================================================
+// Close an opened data partition file, freeing any decompression
+//   state for it.
+// ===============================================================
+void close_data_file(Data_File *file) {
+    if (file->lz4) {
+        wait_data_file_reads(&file->lz4->reads);
+        bs->FreePool(file->lz4);
     }
+    *file = (Data_File){0};
+}
+
+// ===============================================================
+// Read a file in the GPT disk image's raw data partition,
+//   using information found in the data partition file index.
+//
+// Returns: 
+//  - non-null pointer to allocated buffer with file data, 
+//      allocated with Boot Services AllocatePages(), or NULL if not 
+//      found or error.
+//  - Size of returned buffer, if not NULL.
+//
+//  NOTE: Caller will have to use FreePages() on returned buffer to 
+//    free allocated memory.
+// ===============================================================
+VOID *read_data_partition_file_to_buffer(char *in_name, bool executable, UINTN *ret_size) {
+    EFI_PHYSICAL_ADDRESS data_file = 0;
+    EFI_STATUS status = EFI_SUCCESS;
+
+    *ret_size = 0;
 
-    UINTN disk_lba = atoi(str_pos);
+    Data_File file = {0};
+    status = open_data_partition_file(in_name, &file);
+    if (EFI_ERROR(status)) return NULL;
+
+    // Allocate buffer for file data
+    UINTN pages_needed = (file.size + (PAGE_SIZE-1)) / PAGE_SIZE;
+    status = bs->AllocatePages(AllocateAnyPages, 
+                               executable ? EfiLoaderCode : EfiLoaderData, 
+                               pages_needed, 
+                               &data_file);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not Allocate buffer for data partition file '%hhs'.\r\n", in_name);
+        return NULL;
+    }
 
     // Read disk lbas for file into buffer
-    data_file = (VOID *)read_disk_lbas_to_buffer(disk_lba, file_size, image_mediaID, executable);
-    *ret_size = file_size;
-    if (!data_file) {
-        error(0, u"Could not find or read data partition file '%s' to buffer\r\n", in_name);
-        *ret_size = 0;
+    status = read_data_file(&file, 0, file.size, (VOID *)data_file);
+    if (EFI_ERROR(status)) {
+        error(0, u"Could not read data partition file '%hhs' to buffer\r\n", in_name);
+        bs->FreePages(data_file, pages_needed);
+        return NULL;
     } 
 
+    *ret_size = file.size;
+    return (VOID *)data_file;
+}
+
+// ===============================================================
+// Get value of an 8 hex digit cpio "newc" header field 
+// ===============================================================
+UINT32 cpio_field(char *field) {
+    char buf[9] = {0};
+    memcpy(buf, field, 8);
+    return xtoi(buf);
+}
+
+// ===============================================================
+// Free memory for a loaded boot bundle and its modules
+// ===============================================================
+void free_boot_bundle(Boot_Bundle *bundle) {
+    if (bundle->modules) bs->FreePool(bundle->modules);
+    if (bundle->address) bs->FreePages(bundle->address, bundle->pages);
+    *bundle = (Boot_Bundle){0};
+}
+
+// ===============================================================
+// Load the boot bundle archive from the data partition with one
+//   read into one allocation, and get a module for each regular 
+//   file in it. Module data is used in place in the archive.
+//
+// Returns: EFI_NOT_FOUND without printing an error if there is no
+//   bundle, so caller can fall back to separate files.
+// ===============================================================
+EFI_STATUS load_boot_bundle(Boot_Bundle *bundle) {
+    EFI_STATUS status = EFI_SUCCESS;
+    Data_File file = {0};
+
+    *bundle = (Boot_Bundle){0};
+    if (!find_data_partition_file(BOOT_BUNDLE_NAME)) return EFI_NOT_FOUND;
+
+    status = open_data_partition_file(BOOT_BUNDLE_NAME, &file);
+    if (EFI_ERROR(status)) return status;
+
+    bundle->pages = (file.size + (PAGE_SIZE-1)) / PAGE_SIZE;
+    status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, bundle->pages, &bundle->address);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not allocate memory for boot bundle.\r\n");
+        return status;
+    }
+
+    status = read_data_file(&file, 0, file.size, (VOID *)bundle->address);
+    if (!EFI_ERROR(status)) status = verify_data_file(&file);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not read boot bundle from disk.\r\n");
+        goto cleanup;
+    }
+
+    // Count regular files in archive, then fill out modules for them
+    UINT8 *archive = (UINT8 *)bundle->address;
+    for (UINTN pass = 0; pass < 2; pass++) {
+        UINTN pos = 0, count = 0;
+        while (true) {
+            char *hdr = (char *)archive + pos;
+            if (pos + CPIO_NEWC_HEADER_SIZE > file.size || memcmp(hdr, CPIO_NEWC_MAGIC, 6)) {
+                status = EFI_VOLUME_CORRUPTED;
+                error(status, u"Boot bundle is not a valid cpio newc archive at offset %u.\r\n", pos);
+                goto cleanup;
+            }
+
+            UINT32 mode      = cpio_field(hdr + 14);
+            UINT32 data_size = cpio_field(hdr + 54);
+            UINT32 name_size = cpio_field(hdr + 94);    // Includes NULL terminator
+            char *name = hdr + CPIO_NEWC_HEADER_SIZE;
+
+            // Header + name and data are each padded to 4 bytes
+            UINTN data_pos = (pos + CPIO_NEWC_HEADER_SIZE + name_size + 3) & ~3;
+            if (name_size == 0 || data_pos > file.size || data_size > file.size - data_pos) {
+                status = EFI_VOLUME_CORRUPTED;
+                error(status, u"Boot bundle entry at offset %u is past end of archive.\r\n", pos);
+                goto cleanup;
+            }
+            if (!memcmp(name, CPIO_TRAILER, sizeof CPIO_TRAILER)) break;
+
+            if ((mode & 0170000) == 0100000) {   // Regular file
+                if (pass == 1) {
+                    if (name[0] == '.' && name[1] == '/') name += 2;
+                    bundle->modules[count] = (Boot_Module){
+                        .name    = name,
+                        .address = bundle->address + data_pos,
+                        .size    = data_size,
+                    };
+                }
+                count++;
+            }
+            pos = (data_pos + data_size + 3) & ~3;
+        }
+
+        if (pass == 0) {
+            bundle->num_modules = count;
+            status = bs->AllocatePool(EfiLoaderData, 
+                                      count * sizeof *bundle->modules, 
+                                      (VOID **)&bundle->modules);
+            if (EFI_ERROR(status)) {
+                error(status, u"Could not allocate boot bundle module table.\r\n");
+                goto cleanup;
+            }
+        }
+    }
+
     cleanup:
-    if (esp_file) bs->FreePool(esp_file);  
-    return data_file;
+    if (EFI_ERROR(status)) free_boot_bundle(bundle);
+    return status;
+}
+
+// ===============================================================
+// Get a boot bundle module by file name, or name without the 
+//   extension e.g. "kernel" for "kernel.elf"
+//
+// Returns: Pointer to module, or NULL if not found
+// ===============================================================
+Boot_Module *find_boot_module(Boot_Bundle *bundle, char *name) {
+    for (UINTN i = 0; i < bundle->num_modules; i++) 
+        if (file_name_matches(bundle->modules[i].name, name)) return &bundle->modules[i];
+
+    return NULL;
+}
+
+// ===============================================================
+// Open a boot bundle module as a data file, to read it with the
+//   same functions as files on disk
+// ===============================================================
+void open_boot_module(Boot_Module *module, Data_File *file) {
+    *file = (Data_File){
+        .memory = (UINT8 *)module->address,
+        .size   = module->size,
+    };
 }
 
 // ==================================================
@@ -2308,99 +3832,454 @@ EFI_HII_PACKAGE_LIST_HEADER *hii_database_package_list(UINT8 package_type) {
 // if (simple_fonts) bs->FreePool(simple_fonts);
 // ---------------------------------------------------------------------
 
-// ==================================================
-// Allocate pages from available UEFI Memory Map;
-//   technically not allocating more, but returning
-//   available pre-existing page addresses.
-//   Using this as a sort of bump allocator.
-// ==================================================
-void *mmap_allocate_pages(Memory_Map_Info *mmap, UINTN pages) {
-    static void *next_page_address = NULL;  // Next page/page range address to return to caller
-    static UINTN current_descriptor = 0;    // Current descriptor number
-    static UINTN remaining_pages = 0;       // Remaining pages in current descriptor
-
-    if (remaining_pages < pages) {
-        // Not enough remaining pages in current descriptor, find the next available one
-        UINTN i = current_descriptor+1;
-        for (; i < mmap->size / mmap->desc_size; i++) {
-            EFI_MEMORY_DESCRIPTOR *desc = 
-                (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
-
-            if (desc->Type == EfiConventionalMemory && desc->NumberOfPages >= pages) {
-                // Found enough memory to use at this descriptor, use it
-                current_descriptor = i;
-                remaining_pages = desc->NumberOfPages - pages;
-                next_page_address = (void *)(desc->PhysicalStart + (pages * PAGE_SIZE));
-                return (void *)desc->PhysicalStart;
-            }
+// =====================================================================
+// Allocate pages at a physical address aligned to alignment (power of 
+//   2), by allocating extra pages and freeing the unaligned head & tail
+// =====================================================================
+EFI_STATUS allocate_aligned_pages(EFI_MEMORY_TYPE type, UINTN pages, UINTN alignment, 
+                                  EFI_PHYSICAL_ADDRESS *address) {
+    if (alignment <= PAGE_SIZE) return bs->AllocatePages(AllocateAnyPages, type, pages, address);
+
+    UINTN extra_pages = (alignment / PAGE_SIZE) - 1;
+    EFI_PHYSICAL_ADDRESS base = 0;
+    EFI_STATUS status = bs->AllocatePages(AllocateAnyPages, type, pages + extra_pages, &base);
+    if (EFI_ERROR(status)) return status;
+
+    EFI_PHYSICAL_ADDRESS aligned = (base + (alignment-1)) & ~(alignment-1);
+    UINTN head_pages = (aligned - base) / PAGE_SIZE;
+    UINTN tail_pages = extra_pages - head_pages;
+    if (head_pages) bs->FreePages(base, head_pages);
+    if (tail_pages) bs->FreePages(aligned + (pages * PAGE_SIZE), tail_pages);
+
+    *address = aligned;
+    return EFI_SUCCESS;
+}
+
+// ======================================================================
+// Mark a run of pages used or free in page allocator bitmap, a word at a
+//   time where possible. Returns number of pages changed.
+// ======================================================================
+uint64_t mark_physical_pages(Page_Allocator *pa, uint64_t first, uint64_t count, bool used) {
+    uint64_t changed = 0;
+    for (uint64_t page = first; page < first + count; ) {
+        uint64_t bit  = page % 64;
+        uint64_t bits = min(64 - bit, first + count - page);
+        uint64_t mask = (bits == 64) ? UINT64_MAX : ((1ULL << bits) - 1) << bit;
+        uint64_t *word = &pa->bitmap[page / 64];
+        uint64_t old = *word;
+
+        *word = used ? (old | mask) : (old & ~mask);
+        changed += __builtin_popcountll(old ^ *word);
+        page += bits;
+    }
+    return changed;
+}
+
+// Get highest end address of free memory in an EFI memory map
+UINT64 max_free_address(Memory_Map_Info *mmap) {
+    UINT64 max_address = 0;
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+
+        UINT64 end = desc->PhysicalStart + (desc->NumberOfPages * PAGE_SIZE);
+        if (desc->Type == EfiConventionalMemory && end > max_address) max_address = end;
+    }
+    return max_address;
+}
+
+// Get pages needed for a page allocator bitmap tracking all free memory in an EFI memory map
+UINT64 page_bitmap_pages(Memory_Map_Info *mmap) {
+    UINT64 bitmap_bytes = ((max_free_address(mmap) / PAGE_SIZE + 63) / 64) * sizeof(uint64_t);
+    return (bitmap_bytes + (PAGE_SIZE-1)) / PAGE_SIZE;
+}
+
+// ======================================================================
+// Set up physical page allocator from the final EFI memory map, with a 
+//   bitmap of bitmap_pages allocated before getting the map, so the map
+//   already has it as used memory. Only EfiConventionalMemory is free, 
+//   up to what the bitmap can track. Page 0 is never handed out.
+// ======================================================================
+void init_page_allocator(Page_Allocator *pa, Memory_Map_Info *mmap, uint64_t *bitmap, 
+                         uint64_t bitmap_pages) {
+    memset(pa, 0, sizeof *pa);
+    pa->bitmap = bitmap;
+    pa->pages  = min(max_free_address(mmap) / PAGE_SIZE, bitmap_pages * PAGE_SIZE * 8);
+
+    // Start with all pages used, then free conventional memory
+    memset(pa->bitmap, 0xFF, bitmap_pages * PAGE_SIZE);
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+
+        UINT64 first = desc->PhysicalStart / PAGE_SIZE;
+        if (desc->Type != EfiConventionalMemory || first >= pa->pages) continue;
+
+        pa->free_pages += mark_physical_pages(pa, first, min(desc->NumberOfPages, pa->pages - first), 
+                                              false);
+    }
+
+    pa->free_pages -= mark_physical_pages(pa, 0, 1, true);  // Don't hand out page 0 (NULL)
+}
+
+// Pool memory from AllocatePages(), so all of it can be freed if booting the kernel fails
+#define MAX_POOL_CHUNKS 16
+
+typedef struct {
+    EFI_PHYSICAL_ADDRESS address;
+    UINTN pages;
+} Pool_Chunk;
+
+Pool_Chunk pool_chunks[MAX_POOL_CHUNKS] = {0};
+UINTN num_pool_chunks = 0;
+bool pool_locked = false;   // Pool can't grow, e.g. when only GetMemoryMap() & ExitBootServices() 
+                            //   can be called after a failed ExitBootServices()
+
+// =======================================================================
+// Allocate pages before ExitBootServices() from a pool of EfiLoaderData 
+//   memory, getting more with AllocatePages() when it runs out. Fewer 
+//   AllocatePages() calls means less memory map churn; each new pool is
+//   twice the size of the last.
+// =======================================================================
+void *allocate_pool_pages(Page_Allocator *pa, uint64_t pages) {
+    const uint64_t POOL_PAGES = 64;
+
+    if (pages > pa->pool_pages) {
+        if (pool_locked) return NULL;
+        if (num_pool_chunks == MAX_POOL_CHUNKS) {
+            error(0, u"Too many pool allocations for page tables\r\n");
+            return NULL;
         }
 
-        if (i >= mmap->size / mmap->desc_size) {
-            // Ran out of descriptors to check in memory map
-            error(0, u"\r\nCould not find any memory to allocate pages for.\r\n");
+        EFI_PHYSICAL_ADDRESS address = 0;
+        uint64_t new_pages = max(pages, POOL_PAGES << num_pool_chunks);
+        EFI_STATUS status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, new_pages, &address);
+        if (EFI_ERROR(status)) {
+            error(status, u"Could not allocate %llu pages for page tables\r\n", new_pages);
             return NULL;
         }
+
+        if (pa->pool_pages) {   // Rest of the old pool
+            bs->FreePages(pa->pool, pa->pool_pages);
+            pool_chunks[num_pool_chunks-1].pages -= pa->pool_pages;
+        }
+        pool_chunks[num_pool_chunks++] = (Pool_Chunk){ .address = address, .pages = new_pages };
+        pa->pool       = address;
+        pa->pool_pages = new_pages;
+    }
+
+    void *address = (void *)pa->pool;
+    pa->pool       += pages * PAGE_SIZE;
+    pa->pool_pages -= pages;
+    return address;
+}
+
+// Grow the pool if needed so it has at least a number of pages free, for allocations made after
+//   it's locked
+bool reserve_pool_pages(Page_Allocator *pa, uint64_t pages) {
+    if (pages <= pa->pool_pages) return true;
+    if (!allocate_pool_pages(pa, pages)) return false;
+
+    pa->pool       -= pages * PAGE_SIZE;    // Give the pages back to the new pool
+    pa->pool_pages += pages;
+    return true;
+}
+
+// =======================================================================
+// Allocate EfiLoaderData pages below 4GiB before ExitBootServices(), for
+//   memory used with paging off or from 32 bit code. Not from the pool,
+//   but tracked with it so free_pool_pages() frees them too.
+// =======================================================================
+void *allocate_low_pages(uint64_t pages) {
+    if (num_pool_chunks == MAX_POOL_CHUNKS) {
+        error(0, u"Too many pool allocations for page tables\r\n");
+        return NULL;
+    }
+
+    EFI_PHYSICAL_ADDRESS address = 0xFFFFFFFF;  // Highest address allowed
+    EFI_STATUS status = bs->AllocatePages(AllocateMaxAddress, EfiLoaderData, pages, &address);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not allocate %llu pages below 4GiB\r\n", pages);
+        return NULL;
+    }
+
+    // Keep the current pool's chunk last, as growing the pool frees the rest of it from there
+    Pool_Chunk chunk = { .address = address, .pages = pages };
+    if (num_pool_chunks > 0) {
+        pool_chunks[num_pool_chunks] = pool_chunks[num_pool_chunks-1];
+        pool_chunks[num_pool_chunks-1] = chunk;
+    } else {
+        pool_chunks[0] = chunk;
+    }
+    num_pool_chunks++;
+    return (void *)address;
+}
+
+// Free all pool memory, including page tables built in it, when not booting the kernel after all
+void free_pool_pages(Page_Allocator *pa) {
+    for (UINTN i = 0; i < num_pool_chunks; i++)
+        if (pool_chunks[i].pages) bs->FreePages(pool_chunks[i].address, pool_chunks[i].pages);
+
+    num_pool_chunks = 0;
+    pa->pool_pages  = 0;
+    pool_locked     = false;
+}
+
+// ======================================================================
+// Allocate physically contiguous pages, returns NULL if out of memory.
+//   Scans the bitmap a word at a time from the lowest word with a free
+//   page: full words are skipped whole, and within a word, runs of used
+//   or free pages are measured with one count trailing zeros each. Cost
+//   is the number of runs & words passed, not pages; single pages are
+//   found right away. A run that doesn't fit is skipped, so a large
+//   request in fragmented memory still costs a full pass over the runs.
+// ======================================================================
+void *allocate_physical_pages(Page_Allocator *pa, uint64_t pages) {
+    if (!pa->bitmap) return allocate_pool_pages(pa, pages);
+    if (pages == 0 || pages > pa->free_pages) return NULL;
+
+    const uint64_t words = (pa->pages + 63) / 64;
+    while (pa->next_free < words && pa->bitmap[pa->next_free] == UINT64_MAX) pa->next_free++;
+
+    uint64_t run_start = 0, run_pages = 0;
+    for (uint64_t i = pa->next_free; i < words; i++) {
+        uint64_t used = pa->bitmap[i];
+        if (used == UINT64_MAX) {
+            run_pages = 0;
+            continue;
+        }
+
+        for (uint64_t bit = 0; bit < 64; ) {
+            uint64_t rest = used >> bit;    // Bits from here on; zeros shifted in are free pages
+            if (rest & 1) {
+                run_pages = 0;
+                bit += ~rest ? (uint64_t)__builtin_ctzll(~rest) : 64;  // Skip used pages
+                continue;
+            }
+
+            uint64_t free_bits = rest ? (uint64_t)__builtin_ctzll(rest) : 64 - bit;
+            if (run_pages == 0) run_start = (i * 64) + bit;
+            run_pages += free_bits;
+            if (run_pages >= pages) {
+                pa->free_pages -= mark_physical_pages(pa, run_start, pages, true);
+                return (void *)(run_start * PAGE_SIZE);
+            }
+            bit += free_bits;
+        }
     }
 
-    // Else we have at least enough pages for this allocation, return the current spot in 
-    //   the memory map
-    remaining_pages -= pages;
-    void *page = next_page_address;
-    next_page_address = (void *)((UINT8 *)page + (pages * PAGE_SIZE));
-    return page;
+    return NULL;
+}
+
+// =====================================================
+// Free physically contiguous pages back to allocator
+// =====================================================
+void free_physical_pages(Page_Allocator *pa, void *address, uint64_t pages) {
+    uint64_t first = (uint64_t)address / PAGE_SIZE;
+    if (first >= pa->pages) return;
+
+    pa->free_pages += mark_physical_pages(pa, first, min(pages, pa->pages - first), false);
+    if (first / 64 < pa->next_free) pa->next_free = first / 64;
 }
 
 // ===========================================================
 // Identity map a page of memory, virtual = physical address
 // ===========================================================
-extern void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Memory_Map_Info *mmap);
+extern void arch_map_page(uint64_t physical_address, uint64_t virtual_address, Page_Allocator *pa);
+
+void identity_map_page(UINTN address, Page_Allocator *pa) {
+    arch_map_page(address, address, pa);
+}
 
-void identity_map_page(UINTN address, Memory_Map_Info *mmap) {
-    arch_map_page(address, address, mmap);
+// Get direct map flags for an EFI memory type & attributes; runtime services code is executable,
+//   as it's called through the direct map after SetVirtualAddressMap(), and memory that can't be 
+//   write back cached, e.g. MMIO, is mapped as device memory
+UINT32 direct_map_flags(UINT32 type, UINT64 attributes) {
+    return DIRECT_MAP_FLAGS | ((type == EfiRuntimeServicesCode) ? MAP_EXECUTE : 0) |
+           ((attributes & EFI_MEMORY_WB) ? 0 : MAP_DEVICE);
 }
 
 // ======================================================================
-// Initialize new paging setup by identity mapping all available memory 
-//   from EFI memory map
+// Initialize new paging setup by mapping all memory from EFI memory map
+//   at virtual_base + physical address, e.g. 0 for an identity map. 
+//   Physically contiguous descriptors with the same direct map flags are 
+//   mapped together as one range, so that arch code can use large pages 
+//   across descriptor boundaries.
 // ======================================================================
-void identity_map_efi_mmap(Memory_Map_Info *mmap) {
+extern void arch_map_range(uint64_t physical_address, uint64_t virtual_address, uint64_t size, 
+                           uint32_t map_flags, Page_Allocator *pa);
+
+void map_efi_mmap(Memory_Map_Info *mmap, UINT64 virtual_base, Page_Allocator *pa) {
+    UINT64 run_start = 0, run_end = 0;
+    UINT32 run_flags = 0;
+
     for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
         EFI_MEMORY_DESCRIPTOR *desc = 
             (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
 
-        for (UINTN j = 0; j < desc->NumberOfPages; j++)
-            identity_map_page(desc->PhysicalStart + (j * PAGE_SIZE), mmap);
+        if (desc->PhysicalStart == run_end && run_end != run_start &&
+            direct_map_flags(desc->Type, desc->Attribute) == run_flags) {
+            run_end += desc->NumberOfPages * PAGE_SIZE;  // Extend current run
+            continue;
+        }
+
+        if (run_end != run_start) arch_map_range(run_start, virtual_base + run_start, run_end - run_start, 
+                                                  run_flags, pa);
+
+        run_start = desc->PhysicalStart;
+        run_end   = run_start + (desc->NumberOfPages * PAGE_SIZE);
+        run_flags = direct_map_flags(desc->Type, desc->Attribute);
+    }
+
+    if (run_end != run_start) arch_map_range(run_start, virtual_base + run_start, run_end - run_start, 
+                                              run_flags, pa);
+}
+
+// ======================================================================
+// Map memory in a later EFI memory map that wasn't in one already mapped
+//   with map_efi_mmap(): descriptors not inside an old descriptor with 
+//   the same direct map flags. Allocations only split old descriptors, so 
+//   this is usually nothing. Maps are usually in address order, so each
+//   search starts from the last match.
+// ======================================================================
+void map_new_efi_mmap(Memory_Map_Info *mmap, Memory_Map_Info *old_mmap, UINT64 virtual_base, 
+                      Page_Allocator *pa) {
+    const UINTN old_count = old_mmap->size / old_mmap->desc_size;
+    UINTN j = 0;
+
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
+        UINT64 start = desc->PhysicalStart;
+        UINT64 end   = start + (desc->NumberOfPages * PAGE_SIZE);
+
+        UINTN n = 0;
+        for (; n < old_count; n++, j = (j + 1) % old_count) {
+            EFI_MEMORY_DESCRIPTOR *old = 
+                (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)old_mmap->map + (j * old_mmap->desc_size));
+
+            if (old->PhysicalStart <= start && end <= old->PhysicalStart + (old->NumberOfPages * PAGE_SIZE) &&
+                direct_map_flags(old->Type, old->Attribute) == direct_map_flags(desc->Type, desc->Attribute))
+                break;
+        }
+
+        if (n == old_count) arch_map_range(start, virtual_base + start, end - start, 
+                                           direct_map_flags(desc->Type, desc->Attribute), pa);
     }
 }
 
 // ======================================================================
-// Identity map runtime memory descriptors only, to use with
-//   RuntimeServices->SetVirtualAddressMap()
+// Reserve top level page tables for all memory in the direct map without
+//   mapping it, so the kernel can map any of it on page faults with 
+//   lower level tables from its own page allocator
 // ======================================================================
-void set_runtime_address_map(Memory_Map_Info *mmap) {
-    // First get amount of memory to allocate for runtime memory map
-    UINTN runtime_descriptors = 0;
+extern void arch_reserve_range(uint64_t virtual_address, uint64_t size, Page_Allocator *pa);
+
+void reserve_efi_mmap(Memory_Map_Info *mmap, UINT64 virtual_base, Page_Allocator *pa) {
     for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
         EFI_MEMORY_DESCRIPTOR *desc = 
             (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
 
-        if (desc->Attribute & EFI_MEMORY_RUNTIME)
-            runtime_descriptors++;
+        arch_reserve_range(virtual_base + desc->PhysicalStart, desc->NumberOfPages * PAGE_SIZE, pa);
     }
+}
+
+// ======================================================================
+// Map only the memory the kernel uses at entry in the direct map: loader
+//   memory (kernel stack, page tables, Kernel_Parms data) and runtime 
+//   services. Call with the final memory map, so loader memory allocated
+//   for it, e.g. the memory map buffer, is mapped too.
+// ======================================================================
+void map_kernel_entry_memory(Memory_Map_Info *mmap, UINT64 virtual_base, Page_Allocator *pa) {
+    for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
+        EFI_MEMORY_DESCRIPTOR *desc = 
+            (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap->map + (i * mmap->desc_size));
 
-    // Allocate memory for runtime memory map
-    UINTN runtime_mmap_pages = (runtime_descriptors * mmap->desc_size) + ((PAGE_SIZE-1) / PAGE_SIZE);
-    EFI_MEMORY_DESCRIPTOR *runtime_mmap = mmap_allocate_pages(mmap, runtime_mmap_pages);
-    if (!runtime_mmap) {
-        error(0, u"Could not allocate runtime descriptors memory map\r\n");
+        if (desc->Type != EfiLoaderCode && desc->Type != EfiLoaderData && 
+            !(desc->Attribute & EFI_MEMORY_RUNTIME))
+            continue;
+
+        arch_map_range(desc->PhysicalStart, virtual_base + desc->PhysicalStart, 
+                       desc->NumberOfPages * PAGE_SIZE, direct_map_flags(desc->Type, desc->Attribute), pa);
+    }
+}
+
+// =====================================================================
+// Add a loaded kernel segment; if there are too many, the last one is 
+//   extended to cover this one with the permissions of both
+// =====================================================================
+void add_kernel_segment(Kernel_Segments *segments, UINTN offset, UINTN size, UINT32 flags) {
+    if (segments->count == MAX_KERNEL_SEGMENTS) {
+        Kernel_Segment *last = &segments->segments[segments->count-1];
+        last->size   = max(last->offset + last->size, offset + size) - last->offset;
+        last->flags |= flags;
         return;
     }
 
-    // Identity map all runtime descriptors in each descriptor
-    UINTN runtime_mmap_size = runtime_mmap_pages * PAGE_SIZE; 
-    memset(runtime_mmap, 0, runtime_mmap_size);
+    segments->segments[segments->count++] = (Kernel_Segment){
+        .offset = offset,
+        .size   = size,
+        .flags  = flags,
+    };
+}
+
+// =====================================================================
+// Get MAP_* flags for a page of the loaded kernel. A page gets the
+//   permissions of every segment in it; alignment gaps after a segment
+//   take that segment's permissions, so e.g. text padded out to 2MiB 
+//   can still be mapped with a large page. Headers before the first 
+//   segment are read-only.
+// =====================================================================
+UINT32 kernel_page_flags(Kernel_Segments *segments, UINTN offset) {
+    UINT32 flags = 0;
+    bool in_segment = false;
+    Kernel_Segment *last = NULL;    // Last segment starting before this page
+    for (UINTN i = 0; i < segments->count; i++) {
+        Kernel_Segment *seg = &segments->segments[i];
+        if (seg->offset < offset + PAGE_SIZE && offset < seg->offset + seg->size) {
+            flags |= seg->flags;
+            in_segment = true;
+        }
+        if (seg->offset <= offset && (!last || seg->offset > last->offset)) last = seg;
+    }
 
-    // Set all runtime descriptors in new runtime memory map, and identity map them
+    if (!in_segment && last) flags = last->flags;
+    return flags;
+}
+
+// ===========================================================================
+// Map loaded kernel at a virtual address, with runs of pages with the same
+//   permissions mapped together so that arch code can use large pages
+// ===========================================================================
+void map_kernel_segments(EFI_PHYSICAL_ADDRESS kernel_buffer, UINTN kernel_size, 
+                         UINTN virtual_address, Kernel_Segments *segments, Page_Allocator *pa) {
+    UINTN pages = (kernel_size + (PAGE_SIZE-1)) / PAGE_SIZE;
+    UINTN run_start = 0;
+    UINT32 run_flags = kernel_page_flags(segments, 0);
+
+    for (UINTN i = 1; i <= pages; i++) {
+        // Map the current run when permissions change or at the end of the kernel
+        if (i < pages && kernel_page_flags(segments, i * PAGE_SIZE) == run_flags) continue;
+
+        arch_map_range(kernel_buffer + (run_start * PAGE_SIZE),
+                       virtual_address + (run_start * PAGE_SIZE),
+                       (i - run_start) * PAGE_SIZE, run_flags | MAP_GLOBAL, pa);
+        if (i < pages) {
+            run_start = i;
+            run_flags = kernel_page_flags(segments, i * PAGE_SIZE);
+        }
+    }
+}
+
+// ======================================================================
+// Build memory map of runtime descriptors for SetVirtualAddressMap(), 
+//   with virtual addresses of virtual_base + physical address (already 
+//   mapped there), in a buffer with room for all of mmap's descriptors. 
+//   Returns the runtime memory map size.
+// ======================================================================
+UINTN build_runtime_address_map(Memory_Map_Info *mmap, UINT64 virtual_base, 
+                                EFI_MEMORY_DESCRIPTOR *runtime_mmap) {
+    // Set all runtime descriptors in new runtime memory map, with their new virtual addresses
     UINTN curr_runtime_desc = 0;
     for (UINTN i = 0; i < mmap->size / mmap->desc_size; i++) {
         EFI_MEMORY_DESCRIPTOR *desc = 
@@ -2411,16 +4290,22 @@ void set_runtime_address_map(Memory_Map_Info *mmap) {
                 (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)runtime_mmap + (curr_runtime_desc * mmap->desc_size));
 
             memcpy(runtime_desc, desc, mmap->desc_size);    
-            runtime_desc->VirtualStart = runtime_desc->PhysicalStart;
+            runtime_desc->VirtualStart = virtual_base + runtime_desc->PhysicalStart;
             curr_runtime_desc++;
         }
     }
 
-    // Set new virtual addresses for runtime memory via SetVirtualAddressMap()
-    EFI_STATUS status = rs->SetVirtualAddressMap(runtime_mmap_size, 
-                                                 mmap->desc_size, 
-                                                 mmap->desc_version,
-                                                 runtime_mmap);
-    if (EFI_ERROR(status)) error(0, u"SetVirtualAddressMap()\r\n");
+    return curr_runtime_desc * mmap->desc_size;
+}
+
+// ======================================================================
+// Move runtime services to the virtual addresses in a runtime memory map
+//   from build_runtime_address_map(), with 
+//   RuntimeServices->SetVirtualAddressMap(). Only valid after 
+//   ExitBootServices(), so errors can't be printed.
+// ======================================================================
+EFI_STATUS set_runtime_address_map(Memory_Map_Info *mmap, EFI_MEMORY_DESCRIPTOR *runtime_mmap, 
+                                   UINTN runtime_mmap_size) {
+    return rs->SetVirtualAddressMap(runtime_mmap_size, mmap->desc_size, mmap->desc_version, runtime_mmap);
 }
 
@@ -25,6 +25,19 @@
 // Kernel start address in higher memory (64-bit) - last 2 GiBs of virtual memory
 #define KERNEL_START_ADDRESS 0xFFFFFFFF80000000
 
+// All physical memory is mapped for the kernel at this address + physical address; start of
+//   upper half of 48 bit virtual memory
+#define DIRECT_MAP_BASE 0xFFFF800000000000
+
+// Direct map address with 5 level paging; start of upper half of 57 bit virtual memory
+#define DIRECT_MAP_BASE_5_LEVEL 0xFF00000000000000
+
+// Top level page table entry that maps the page tables themselves, for the kernel; between the
+//   direct map & the kernel by default. Can override with e.g. CFLAGS += -D RECURSIVE_SLOT=<n>
+#ifndef RECURSIVE_SLOT
+#define RECURSIVE_SLOT 510
+#endif
+
 #ifdef __clang__
 int _fltused = 0;   // If using floating point code & lld-link, need to define this
 #endif
@@ -43,6 +56,10 @@ extern EFI_HANDLE image;                        // Image handle
 
 extern INT32 text_rows, text_cols;              // Current text screen size rows & columns
 
+extern Data_Partition_Index data_index;         // Index of data partition files
+extern Disk_Registry disk_registry;             // Disk devices and their Block IO/Disk IO protocols
+extern Boot_Profile boot_profile;               // Loader boot stage timestamps
+
 EFI_EVENT timer_event;  // Global timer event
 
 // Mouse cursor buffer 8x8
@@ -61,6 +78,7 @@ EFI_GRAPHICS_OUTPUT_BLT_PIXEL cursor_buffer[] = {
 EFI_GRAPHICS_OUTPUT_BLT_PIXEL save_buffer[8*8] = {0};
 
 bool autoload_kernel = false;   // Autoload kernel instead of main menu?
+bool minimal_mappings = false;  // Only direct map what the kernel needs at entry, it maps the rest?
 
 // ====================
 // Set Text Mode
@@ -1050,11 +1068,6 @@ EFI_STATUS print_block_io_partitions(void) {
 
     cout->ClearScreen(cout);
 
-    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
-    EFI_BLOCK_IO_PROTOCOL *biop;
-    UINTN num_handles = 0;
-    EFI_HANDLE *handle_buffer = NULL;
-
     // Get media ID for this disk image first, to compare to others in output
     UINT32 this_image_media_id = 0;
     status = get_disk_image_mediaID(&this_image_media_id);
@@ -1064,32 +1077,15 @@ EFI_STATUS print_block_io_partitions(void) {
     }
 
     // Loop through and print all partition information found
-    status = bs->LocateHandleBuffer(ByProtocol, &bio_guid, NULL, &num_handles, &handle_buffer);
-    if (EFI_ERROR(status)) {
-        error(status, u"Could not locate any Block IO Protocols.\r\n");
-        return status;
-    }
-
-    UINT32 last_media_id = -1;  // Keep track of currently opened Media info
-    for (UINTN i = 0; i < num_handles; i++) {
-        status = bs->OpenProtocol(handle_buffer[i], 
-                                  &bio_guid,
-                                  (VOID **)&biop,
-                                  image,
-                                  NULL,
-                                  EFI_OPEN_PROTOCOL_GET_PROTOCOL);
-
-        if (EFI_ERROR(status)) {
-            error(status, u"Could not Open Block IO protocol on handle %u.\r\n", i);
-            continue;
-        }
+    for (UINTN i = 0; i < disk_registry.num_handles; i++) {
+        Block_IO_Handle *bio_handle = &disk_registry.handles[i];
+        EFI_BLOCK_IO_PROTOCOL *biop = bio_handle->biop;
 
         // Print Block IO Media Info for this Disk/partition
-        if (last_media_id != biop->Media->MediaId) {
-            last_media_id = biop->Media->MediaId;   
+        if (i == 0 || disk_registry.handles[i-1].biop->Media->MediaId != biop->Media->MediaId) {
             printf_c16(u"Media ID: %u %s\r\n", 
-                   last_media_id, 
-                   (last_media_id == this_image_media_id ? u"(Disk Image)" : u""));
+                   biop->Media->MediaId, 
+                   (biop->Media->MediaId == this_image_media_id ? u"(Disk Image)" : u""));
         }
 
         if (biop->Media->LastBlock == 0) {
@@ -1116,18 +1112,9 @@ EFI_STATUS print_block_io_partitions(void) {
         // Print type of partition e.g. ESP or Data or Other
         if (!biop->Media->LogicalPartition) printf_c16(u"<Entire Disk>\r\n");
         else {
-            // Get partition info protocol for this partition
-            EFI_GUID pi_guid = EFI_PARTITION_INFO_PROTOCOL_GUID;
-            EFI_PARTITION_INFO_PROTOCOL *pip = NULL;
-            status = bs->OpenProtocol(handle_buffer[i], 
-                                      &pi_guid,
-                                      (VOID **)&pip,
-                                      image,
-                                      NULL,
-                                      EFI_OPEN_PROTOCOL_GET_PROTOCOL);
-
-            if (EFI_ERROR(status)) {
-                error(status, u"Could not Open Partition Info protocol on handle %u.\r\n", i);
+            EFI_PARTITION_INFO_PROTOCOL *pip = bio_handle->pip;
+            if (!pip) {
+                error(EFI_NOT_FOUND, u"Could not Open Partition Info protocol on handle %u.\r\n", i);
             } else {
                 if      (pip->Type == PARTITION_TYPE_OTHER) printf_c16(u"<Other Type>\r\n");
                 else if (pip->Type == PARTITION_TYPE_MBR)   printf_c16(u"<MBR>\r\n");
@@ -1153,11 +1140,80 @@ EFI_STATUS print_block_io_partitions(void) {
     return EFI_SUCCESS;
 }
 
-// ==========================================================
+// ===================================================================
+// Read the headers at the start of a kernel file on disk into a new 
+//   buffer; enough for the ELF header & program headers, or the PE 
+//   headers & section headers. Otherwise only the first page is read. 
+//
+// Returns: non-null pointer to buffer allocated with AllocatePool(),
+//   or NULL on error. Caller will have to use FreePool() on it.
+// ===================================================================
+VOID *read_kernel_headers(Data_File *file, UINTN *hdr_size) {
+    VOID *hdr_buffer = NULL;
+    UINTN size = file->size < PAGE_SIZE ? file->size : PAGE_SIZE;
+
+    while (true) {
+        EFI_STATUS status = bs->AllocatePool(EfiLoaderData, size, &hdr_buffer);
+        if (EFI_ERROR(status)) {
+            error(status, u"Could not allocate buffer for kernel headers.\r\n");
+            return NULL;
+        }
+
+        if (EFI_ERROR(read_data_file(file, 0, size, hdr_buffer))) goto failed;
+
+        // Get size of all headers needed to load the file
+        UINT8 *hdr = hdr_buffer;
+        UINTN needed = size;
+        if (size >= sizeof(ELF_Header_64) && !memcmp(hdr, (UINT8[4]){0x7F, 'E', 'L', 'F'}, 4)) {
+            ELF_Header_64 *ehdr = hdr_buffer;
+            needed = ehdr->e_phoff + (ehdr->e_phnum * sizeof(ELF_Program_Header_64));
+
+        } else if (size >= 0x40 && !memcmp(hdr, (UINT8[2]){'M', 'Z'}, 2)) {
+            UINT32 pe_sig_pos = *(UINT32 *)(hdr + 0x3C);
+            PE_Coff_File_Header_64 *coff_hdr = (PE_Coff_File_Header_64 *)(hdr + pe_sig_pos + 4);
+            if (pe_sig_pos + 4 + sizeof *coff_hdr + sizeof(PE_Optional_Header_64) > size) {
+                error(0, u"PE headers are not in the first page of the kernel file.\r\n");
+                goto failed;
+            }
+
+            PE_Optional_Header_64 *opt_hdr = (PE_Optional_Header_64 *)(coff_hdr + 1);
+            UINTN section_hdrs_end = pe_sig_pos + 4 + sizeof *coff_hdr + 
+                                     coff_hdr->SizeOfOptionalHeader +
+                                     (coff_hdr->NumberOfSections * sizeof(PE_Section_Header_64));
+            needed = max(opt_hdr->SizeOfHeaders, section_hdrs_end);
+        }
+
+        if (needed > file->size) {
+            error(0, u"Kernel headers are larger than kernel file.\r\n");
+            goto failed;
+        }
+
+        if (needed <= size) break;
+
+        // Headers go past what was read, read again with the full size
+        bs->FreePool(hdr_buffer);
+        size = needed;
+    }
+
+    *hdr_size = size;
+    return hdr_buffer;
+
+    failed:
+    bs->FreePool(hdr_buffer);
+    return NULL;
+}
+
+// ===================================================================
 // Load an ELF64 PIE file into a new buffer, and return the 
-//   entry point for the loaded ELF program
-// ==========================================================
-VOID *load_elf(VOID *elf_buffer, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_size) {
+//   entry point for the loaded ELF program.
+// elf_buffer only needs the ELF header & program headers; each
+//   loadable segment is read from the file on disk straight into 
+//   its place in the new buffer. Reads are started in the reads 
+//   batch, and caller must wait on it before using the new buffer.
+// Each loadable segment's permissions are added to segments.
+// ===================================================================
+VOID *load_elf(VOID *elf_buffer, Data_File *file, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_size,
+               Data_File_Reads *reads, Kernel_Segments *segments) {
     ELF_Header_64 *ehdr = elf_buffer;
 
     // Only allow PIE ELF files
@@ -1192,6 +1248,10 @@ VOID *load_elf(VOID *elf_buffer, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_
         if (hdr_end   > mem_max) mem_max = hdr_end;
     }
 
+    // Keep 2MiB aligned virtual addresses at 2MiB aligned offsets in the buffer, if the program is
+    //   big enough for large pages
+    if (mem_max - mem_min >= LARGE_PAGE_SIZE) mem_min &= ~(UINTN)(LARGE_PAGE_SIZE-1);
+
     UINTN max_memory_needed = mem_max - mem_min;   
 
     // Allocate buffer for program headers
@@ -1199,20 +1259,23 @@ VOID *load_elf(VOID *elf_buffer, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_
     EFI_PHYSICAL_ADDRESS program_buffer = 0;
     UINTN pages_needed = (max_memory_needed + (PAGE_SIZE-1)) / PAGE_SIZE;
 
-    status = bs->AllocatePages(AllocateAnyPages, EfiLoaderCode, pages_needed, &program_buffer);
+    // Align buffer to at least 2MiB if program is big enough, so 2MiB aligned segments are
+    //   2MiB aligned physically too and can be mapped with large pages
+    UINTN buffer_alignment = max_alignment;
+    if (max_memory_needed >= LARGE_PAGE_SIZE) buffer_alignment = max(max_alignment, LARGE_PAGE_SIZE);
+
+    status = allocate_aligned_pages(EfiLoaderCode, pages_needed, buffer_alignment, &program_buffer);
     if (EFI_ERROR(status)) {
         error(status, u"Could not allocate memory for ELF program\r\n");
         return NULL;
     }
 
-    // Zero init buffer, to ensure 0 padding for all program sections
-    memset((VOID *)program_buffer, 0, max_memory_needed);
-
     // Fill out input parms for caller
     *file_buffer = program_buffer;
     *file_size   = pages_needed * PAGE_SIZE;
 
     // Load program headers into buffer
+    UINTN filled = 0;   // Buffer is filled in up to this relative offset
     phdr = (ELF_Program_Header_64 *)((UINT8 *)ehdr + ehdr->e_phoff);
     for (UINT16 i = 0; i < ehdr->e_phnum; i++, phdr++) {
         // Only interested in loadable program headers
@@ -1222,25 +1285,50 @@ VOID *load_elf(VOID *elf_buffer, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_
         //   With PIE executables, this means we can use any entry point or addresses, as long as
         //   we use the same relative addresses.
         UINTN relative_offset = phdr->p_vaddr - mem_min;
+        UINT8 *dst = (UINT8 *)program_buffer + relative_offset; 
+
+        // 0-init any alignment gap between the last segment and this one
+        if (relative_offset > filled) 
+            memset((UINT8 *)program_buffer + filled, 0, relative_offset - filled);
 
-        // Read p_filesz amount of data from p_offset in original file buffer,
+        // Read p_filesz amount of data from p_offset in the file on disk,
         //   to the same relative offset of p_vaddr in new buffer
-        UINT8 *dst = (UINT8 *)program_buffer + relative_offset; 
-        UINT8 *src = (UINT8 *)elf_buffer     + phdr->p_offset;
-        UINT32 len = phdr->p_filesz;
-        memcpy(dst, src, len);
+        status = read_data_file_async(file, phdr->p_offset, phdr->p_filesz, dst, reads);
+        if (EFI_ERROR(status)) {
+            error(status, u"Could not read ELF program header %u from disk.\r\n", (UINTN)i);
+            return NULL;
+        }
+
+        // Only the part of the segment past the file data needs to be 0-padded e.g. .bss
+        memset(dst + phdr->p_filesz, 0, phdr->p_memsz - phdr->p_filesz);
+
+        if (relative_offset + phdr->p_memsz > filled) filled = relative_offset + phdr->p_memsz;
+
+        add_kernel_segment(segments, relative_offset, phdr->p_memsz,
+                           ((phdr->p_flags & PF_W) ? MAP_WRITE   : 0) | 
+                           ((phdr->p_flags & PF_X) ? MAP_EXECUTE : 0));
     }
 
+    // 0-init the rest of the buffer after the last segment
+    if (filled < max_memory_needed) 
+        memset((UINT8 *)program_buffer + filled, 0, max_memory_needed - filled);
+
     // Return entry point in new buffer, with same relative offset as in the original buffer 
     VOID *entry_point = (VOID *)((UINT8 *)program_buffer + (ehdr->e_entry - mem_min));
     return entry_point;
 }
 
-// ==========================================================
+// ===================================================================
 // Load an PE32+ PIE file into a new buffer, and return the 
 //   entry point for the loaded PE program
-// ==========================================================
-VOID *load_pe(VOID *pe_buffer, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_size) {
+// pe_buffer only needs the PE headers & section headers; each
+//   section is read from the file on disk straight into its place 
+//   in the new buffer. Reads are started in the reads batch, and 
+//   caller must wait on it before using the new buffer.
+// Each section's permissions are added to segments.
+// ===================================================================
+VOID *load_pe(VOID *pe_buffer, Data_File *file, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_size,
+              Data_File_Reads *reads, Kernel_Segments *segments) {
     // Get COFF header
     UINT8 pe_sig_offset = 0x3C; // From PE file format
     UINT32 pe_sig_pos = *(UINT32 *)((UINT8 *)pe_buffer + pe_sig_offset);
@@ -1278,15 +1366,19 @@ VOID *load_pe(VOID *pe_buffer, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_si
     EFI_PHYSICAL_ADDRESS program_buffer = 0;
     EFI_STATUS status = 0;
     UINTN pages_needed = (opt_hdr->SizeOfImage + (PAGE_SIZE-1)) / PAGE_SIZE;
-    status = bs->AllocatePages(AllocateAnyPages, EfiLoaderCode, pages_needed, &program_buffer);
+
+    // Align buffer to 2MiB if image is big enough, so 2MiB aligned sections can be mapped 
+    //   with large pages
+    UINTN buffer_alignment = PAGE_SIZE;
+    if (opt_hdr->SizeOfImage >= LARGE_PAGE_SIZE) 
+        buffer_alignment = max(opt_hdr->SectionAlignment, LARGE_PAGE_SIZE);
+
+    status = allocate_aligned_pages(EfiLoaderCode, pages_needed, buffer_alignment, &program_buffer);
     if (EFI_ERROR(status)) {
         error(status, u"Could not allocate memory for PE file.\r\n");
         return NULL;
     }
 
-    // Initialize buffer to 0, which should also take care of needing to 0-pad sections between
-    //   Raw Data and Virtual Size
-    memset((VOID *)program_buffer, 0, opt_hdr->SizeOfImage);
     *file_buffer = program_buffer;
     *file_size   = pages_needed * PAGE_SIZE;
 
@@ -1295,15 +1387,40 @@ VOID *load_pe(VOID *pe_buffer, EFI_PHYSICAL_ADDRESS *file_buffer, UINTN *file_si
     PE_Section_Header_64 *shdr = 
         (PE_Section_Header_64 *)((UINT8 *)opt_hdr + coff_hdr->SizeOfOptionalHeader);
 
+    UINTN filled = 0;   // Buffer is filled in up to this RVA; sections are in ascending RVA order
     for (UINT16 i = 0; i < coff_hdr->NumberOfSections; i++, shdr++) {
+        add_kernel_segment(segments, shdr->VirtualAddress, max(shdr->VirtualSize, shdr->SizeOfRawData),
+                           ((shdr->Characteristics & IMAGE_SCN_MEM_WRITE)   ? MAP_WRITE   : 0) | 
+                           ((shdr->Characteristics & IMAGE_SCN_MEM_EXECUTE) ? MAP_EXECUTE : 0));
+
         if (shdr->SizeOfRawData == 0) continue;
 
-        VOID *dst = (UINT8 *)program_buffer + shdr->VirtualAddress;
-        VOID *src = (UINT8 *)pe_buffer + shdr->PointerToRawData;
+        UINT8 *dst = (UINT8 *)program_buffer + shdr->VirtualAddress;
         UINTN len = shdr->SizeOfRawData;
-        memcpy(dst, src, len);
+        if (shdr->VirtualSize && len > shdr->VirtualSize) 
+            len = shdr->VirtualSize;    // Raw data is padded to FileAlignment, don't read padding
+
+        // 0-init any gap between the last section (or headers) and this one
+        if (shdr->VirtualAddress > filled) 
+            memset((UINT8 *)program_buffer + filled, 0, shdr->VirtualAddress - filled);
+
+        status = read_data_file_async(file, shdr->PointerToRawData, len, dst, reads);
+        if (EFI_ERROR(status)) {
+            error(status, u"Could not read PE section %u from disk.\r\n", (UINTN)i);
+            return NULL;
+        }
+
+        // Only 0-pad the section between Raw Data and Virtual Size
+        if (shdr->VirtualSize > len) memset(dst + len, 0, shdr->VirtualSize - len);
+
+        UINTN section_end = shdr->VirtualAddress + max(len, shdr->VirtualSize);
+        if (section_end > filled) filled = section_end;
     }
 
+    // 0-init the rest of the image after the last section, e.g. sections without raw data
+    if (filled < opt_hdr->SizeOfImage) 
+        memset((UINT8 *)program_buffer + filled, 0, opt_hdr->SizeOfImage - filled);
+
     // Return entry point
     VOID *entry_point = (UINT8 *)program_buffer + opt_hdr->AddressOfEntryPoint;
     return entry_point;
@@ -1353,12 +1470,53 @@ EFI_STATUS get_memory_map(Memory_Map_Info *mmap) {
     return EFI_SUCCESS;
 }
 
+// ======================================================================
+// Convert pointers in kernel parameters to direct map addresses for the
+//   kernel. Physical address fields e.g. framebuffer, module addresses &
+//   memory map descriptors stay physical.
+// ======================================================================
+void *direct_map_pointer(void *pointer, UINT64 direct_map_base) {
+    return pointer ? (void *)(direct_map_base + (UINT64)pointer) : NULL;
+}
+
+void direct_map_kernel_parms(Kernel_Parms *kparms) {
+    const UINT64 base = kparms->direct_map_base;
+
+    kparms->mmap.map            = direct_map_pointer(kparms->mmap.map, base);
+    kparms->gop_mode.Info       = direct_map_pointer(kparms->gop_mode.Info, base);
+    kparms->RuntimeServices     = direct_map_pointer(kparms->RuntimeServices, base);
+    kparms->ConfigurationTable  = direct_map_pointer(kparms->ConfigurationTable, base);
+    kparms->page_allocator.bitmap = direct_map_pointer(kparms->page_allocator.bitmap, base);
+
+    for (UINTN i = 0; i < kparms->num_fonts; i++) {
+        kparms->fonts[i].name   = direct_map_pointer(kparms->fonts[i].name, base);
+        kparms->fonts[i].glyphs = direct_map_pointer(kparms->fonts[i].glyphs, base);
+    }
+    kparms->fonts = direct_map_pointer(kparms->fonts, base);
+
+    for (UINTN i = 0; i < kparms->num_modules; i++) 
+        kparms->modules[i].name = direct_map_pointer(kparms->modules[i].name, base);
+    kparms->modules = direct_map_pointer(kparms->modules, base);
+
+    for (UINT32 i = 0; i < kparms->profile.num_stages; i++) 
+        kparms->profile.stages[i].name = direct_map_pointer(kparms->profile.stages[i].name, base);
+}
+
 // ==========================================
 // Read a file from the basic data partition
 // ==========================================
 EFI_STATUS load_kernel(void) {
     EFI_HII_PACKAGE_LIST_HEADER *pkg_list = NULL;   
     EFI_STATUS status = EFI_SUCCESS;
+    Data_File_Reads reads = {0};    // Kernel & font file reads, overlapped with GOP & HII setup
+    Boot_Bundle bundle = {0};       // Kernel, font & other modules for kernel in one archive
+    Data_File kernel_file = {0};    // Kernel file in boot bundle or data partition
+    VOID *disk_buffer = NULL;       // Kernel file headers
+    Data_File psf_file = {0};       // PSF font file in data partition, if not in boot bundle
+    EFI_PHYSICAL_ADDRESS psf_buffer = 0;
+    UINTN psf_pages = 0;            // Pages allocated for psf_buffer, 0 if in boot bundle
+    Page_Allocator boot_pa = {0};   // Page tables & other kernel memory before ExitBootServices()
+    Memory_Map_Info boot_mmap = {0};    // Memory map the direct map was built from
 
     // Defined in efi_lib.h
     Kernel_Parms kparms = {     
@@ -1372,14 +1530,35 @@ EFI_STATUS load_kernel(void) {
     };
 
     cout->ClearScreen(cout);
-
-    // Get kernel file from data partition on disk 
-    UINTN file_size = 0;
-    VOID *disk_buffer = read_data_partition_file_to_buffer("kernel", false, &file_size);
-    if (!disk_buffer) {
-        error(0, u"Could not find or read kernel file to buffer\r\n");
+    boot_stage("Start load kernel");
+
+    // Get file locations in data partition from ESP file manifest
+    if (EFI_ERROR(build_data_partition_index())) goto cleanup;
+    boot_stage("Parse file manifest");
+
+    // Load boot bundle if there is one, to get the kernel, font & other modules with one read
+    //   instead of reading each file from disk separately
+    status = load_boot_bundle(&bundle);
+    if (EFI_ERROR(status) && status != EFI_NOT_FOUND) goto cleanup;
+
+    kparms.num_modules = bundle.num_modules;
+    kparms.modules     = bundle.modules;
+    boot_stage("Read boot bundle");
+
+    // Open kernel file in boot bundle or data partition on disk, and only read its headers for 
+    //   now; the rest of the file is read straight into the loaded kernel's pages.
+    //   LZ4 compressed kernels are decompressed into place while streaming from disk.
+    UINTN hdr_size = 0;
+    Boot_Module *kernel_module = find_boot_module(&bundle, "kernel");
+    if (kernel_module) open_boot_module(kernel_module, &kernel_file);
+
+    if ((!kernel_module && EFI_ERROR(open_data_partition_file("kernel", &kernel_file))) ||
+        EFI_ERROR(open_lz4_data_file(&kernel_file)) ||
+        !(disk_buffer = read_kernel_headers(&kernel_file, &hdr_size))) {
+        error(0, u"Could not find or read kernel file headers to buffer\r\n");
         goto cleanup;
     }
+    boot_stage("Read kernel headers");
 
     // Load Kernel binary depending on format (initial header bytes)
     UINT8 *hdr = disk_buffer;
@@ -1388,6 +1567,7 @@ EFI_STATUS load_kernel(void) {
 
     EFI_PHYSICAL_ADDRESS kernel_buffer = 0;
     UINTN kernel_size = 0;
+    Kernel_Segments kernel_segments = {0};  // Permissions for each part of the loaded kernel
 
     // Load kernel binary and get the entry point
     // Get around compiler warning about function vs void pointer
@@ -1395,24 +1575,41 @@ EFI_STATUS load_kernel(void) {
     Entry_Point entry_point = NULL;
 
     printf_c16(u"File Format: ");
-    if (!memcmp(hdr, (UINT8[4]){0x7F, 'E', 'L', 'F'}, 4)) {
+    if (hdr_size >= 4 && !memcmp(hdr, (UINT8[4]){0x7F, 'E', 'L', 'F'}, 4)) {
         printf_c16(u"ELF\r\n");
         print_elf_info(disk_buffer); // Print ELF header and loadable program header information
-        *(void **)&entry_point = load_elf(disk_buffer, &kernel_buffer, &kernel_size);   
+        *(void **)&entry_point = load_elf(disk_buffer, &kernel_file, &kernel_buffer, &kernel_size, 
+                                                  &reads, &kernel_segments);   
 
-    } else if (!memcmp(hdr, (UINT8[2]){'M', 'Z'}, 2)) {
+    } else if (hdr_size >= 2 && !memcmp(hdr, (UINT8[2]){'M', 'Z'}, 2)) {
         printf_c16(u"PE\r\n");
         print_pe_info(disk_buffer); // Print PE header and loadable section header information
-        *(void **)&entry_point = load_pe(disk_buffer, &kernel_buffer, &kernel_size); 
+        *(void **)&entry_point = load_pe(disk_buffer, &kernel_file, &kernel_buffer, &kernel_size, 
+                                                 &reads, &kernel_segments); 
 
     } else {
         printf_c16(u"No format found, assuming flat binary file\r\n");
-        // Flat binary executable code assumed to start at the beginning of the loaded buffer
-        *(void **)&entry_point = disk_buffer;   
-        kernel_buffer = (EFI_PHYSICAL_ADDRESS)disk_buffer;
-        kernel_size = file_size;
+        // Flat binary executable code assumed to start at the beginning of the file,
+        //   read the whole file into new executable pages. There are no segments to know what is
+        //   code or data, so all of it is mapped writable & executable.
+        kernel_size = kernel_file.size;
+        status = allocate_aligned_pages(EfiLoaderCode, 
+                                        (kernel_size + (PAGE_SIZE-1)) / PAGE_SIZE, 
+                                        kernel_size >= LARGE_PAGE_SIZE ? LARGE_PAGE_SIZE : PAGE_SIZE,
+                                        &kernel_buffer);
+        if (EFI_ERROR(status)) {
+            error(status, u"Could not allocate memory for flat binary kernel.\r\n");
+            goto cleanup;
+        }
+
+        if (!EFI_ERROR(read_data_file_async(&kernel_file, 0, kernel_size, (VOID *)kernel_buffer, &reads)))
+            *(void **)&entry_point = (VOID *)kernel_buffer;   
+
+        add_kernel_segment(&kernel_segments, 0, kernel_size, MAP_WRITE | MAP_EXECUTE);
     }
 
+    boot_stage("Parse kernel & start reads");
+
     // Get new higher address kernel entry point to use
     UINTN entry_offset = (UINTN)entry_point - kernel_buffer;
     Entry_Point higher_entry_point = (Entry_Point)(KERNEL_START_ADDRESS + entry_offset);
@@ -1423,16 +1620,40 @@ EFI_STATUS load_kernel(void) {
             kernel_buffer, kernel_size, (UINTN)entry_point, higher_entry_point);
 
     if (!entry_point) {   
-        // Clean up/free pages for allocated kernel buffer
-        bs->FreePages(kernel_buffer, kernel_size / PAGE_SIZE);
+        // Clean up/free pages for allocated kernel buffer, after any reads into it are done
+        wait_data_file_reads(&reads);
+        bs->FreePages(kernel_buffer, (kernel_size + (PAGE_SIZE-1)) / PAGE_SIZE);
         goto cleanup;     
     }
 
+    // Start reading PSF font file for another bitmap font to use, while kernel reads are
+    //   still in flight; this one should be stored in the boot bundle or disk image's 
+    //   data partition
+    char *psf_name = "ter-132n.psf";
+    Boot_Module *psf_module = find_boot_module(&bundle, psf_name);
+    if (psf_module) {
+        psf_buffer = psf_module->address;   // Already in memory, use in place
+    } else if (!EFI_ERROR(open_data_partition_file(psf_name, &psf_file))) {
+        psf_pages = (psf_file.size + (PAGE_SIZE-1)) / PAGE_SIZE;
+        if (EFI_ERROR(bs->AllocatePages(AllocateAnyPages, EfiLoaderData, psf_pages, &psf_buffer))) {
+            psf_buffer = 0;
+            psf_pages  = 0;
+        } else if (EFI_ERROR(read_data_file_async(&psf_file, 0, psf_file.size, 
+                                                  (VOID *)psf_buffer, &reads))) {
+            bs->FreePages(psf_buffer, psf_pages);
+            psf_buffer = 0;
+            psf_pages  = 0;
+        }
+    }
+
+    boot_stage("Start font read");
+
     if (!autoload_kernel) {
         printf_c16(u"\r\nPress ESC to abort, or another key to load kernel...\r\n");
         EFI_INPUT_KEY key = get_key();
         if (key.ScanCode == SCANCODE_ESC)
             goto cleanup;
+        boot_stage("Wait for key");     // Time waiting on the user, not loading
     }
 
     // Close Timer Event so that it does not continue to fire off
@@ -1475,6 +1696,7 @@ EFI_STATUS load_kernel(void) {
     }
 
     kparms.gop_mode = *gop->Mode;
+    boot_stage("Set GOP mode");
 
     // Allocate buffer for kernel bitmap fonts
     kparms.num_fonts = 2;
@@ -1485,6 +1707,7 @@ EFI_STATUS load_kernel(void) {
         error(status, u"Could not allocate buffer for kernel bitmap font parms.\r\n");
         goto cleanup;
     }
+    memset(kparms.fonts, 0, kparms.num_fonts * sizeof *kparms.fonts);
 
     // Get simple font info & glyphs from HII database for kernel to use as a bitmap font 
     //   for printing
@@ -1531,13 +1754,49 @@ EFI_STATUS load_kernel(void) {
         }
     }
 
-    // Get PSF font file for another bitmap font to use;
-    //   this one should be stored in the disk image's data partition
-    char *psf_name = "ter-132n.psf";
-    UINTN psf_size = 0;
-    VOID *psf_font = read_data_partition_file_to_buffer(psf_name, false, &psf_size);
-    if (psf_font) {
-        PSF2_Header *psf2_hdr = psf_font;
+    boot_stage("Export HII font");
+
+    // Kernel and PSF font file have to be fully read before continuing
+    status = wait_data_file_reads(&reads);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not read kernel or font file from disk.\r\n");
+        goto cleanup;
+    }
+    boot_stage("Wait for disk reads");
+
+    // Refuse to load a kernel that was not read intact from disk; a bad font is only skipped
+    status = verify_data_file(&kernel_file);
+    if (EFI_ERROR(status)) {
+        error(status, u"Kernel file failed checksum verification, not loading it.\r\n");
+        goto cleanup;
+    }
+
+    if (psf_buffer && EFI_ERROR(verify_data_file(&psf_file))) {
+        error(0, u"PSF font file failed checksum verification, not using it.\r\n");
+        bs->FreePages(psf_buffer, psf_pages);
+        psf_buffer = 0;
+        psf_pages  = 0;
+    }
+    close_data_file(&psf_file);
+    boot_stage("Verify checksums");
+
+    boot_profile_finish_calibration();  // Frequency to print times with
+    if (kernel_file.lz4) {
+        printf_c16(u"LZ4 kernel %u -> %u bytes; read: %llu us, decompress: %llu us\r\n",
+                   kernel_file.lz4->raw.size, kernel_file.size, 
+                   ticks_to_us(kernel_file.lz4->read_ticks), 
+                   ticks_to_us(kernel_file.lz4->decompress_ticks));
+    }
+    close_data_file(&kernel_file);
+
+    Disk_Device *image_disk = find_disk_device(disk_registry.image_media_id);
+    if (image_disk && image_disk->read_calls) {
+        printf_c16(u"Disk image reads: %llu calls, %llu bytes, %llu us\r\n",
+                   image_disk->read_calls, image_disk->bytes_read, ticks_to_us(image_disk->read_ticks));
+    }
+
+    if (psf_buffer) {
+        PSF2_Header *psf2_hdr = (PSF2_Header *)psf_buffer;
         kparms.fonts[1] = (Bitmap_Font){
             .name            = psf_name,
             .width           = psf2_hdr->width,
@@ -1548,70 +1807,180 @@ EFI_STATUS load_kernel(void) {
         };
     }
 
-    // Get Memory Map
-    if (EFI_ERROR(get_memory_map(&kparms.mmap))) goto cleanup;
-
-    // Exit boot services before calling kernel
-    UINTN retries = 0;
-    const UINTN MAX_RETRIES = 5;
-    while (EFI_ERROR(bs->ExitBootServices(image, kparms.mmap.key)) && retries < MAX_RETRIES) {
-        // firmware could do a partial shutdown, need to get memory map again
-        //   and try exit boot services again 
-        bs->FreePool(kparms.mmap.map);
-        if (EFI_ERROR(get_memory_map(&kparms.mmap))) goto cleanup;
-        retries++;
-    }
-    if (retries == MAX_RETRIES) {
-        error(0, u"Could not Exit Boot Services!\r\n");
-        goto cleanup;
-    }
+    // Build page tables while boot services are still available, so failures can be reported,
+    //   and only late changes are left for after ExitBootServices(). Page tables & kernel stack 
+    //   are EfiLoaderData memory, so they stay reserved in the final memory map.
+    arch_init_page_tables(&boot_pa);
+    kparms.paging_features = arch_paging_features();
+    kparms.paging_levels   = arch_paging_levels();
 
-    // Initialize page tables
-    arch_init_page_tables(&kparms.mmap);
+    arch_set_recursive_slot(RECURSIVE_SLOT);
+    kparms.recursive_slot = RECURSIVE_SLOT;
 
-    // Identity mapping all available memory 
-    identity_map_efi_mmap(&kparms.mmap);
+    // Direct map all memory in the larger upper half with 5 level paging
+    const UINT64 direct_map_base = (kparms.paging_levels == 5) ? DIRECT_MAP_BASE_5_LEVEL : DIRECT_MAP_BASE;
 
-    // Identity map runtime services memory & set new runtime address map
-    set_runtime_address_map(&kparms.mmap);
+    // Map framebuffer in direct map first with write combining if supported, else uncached, as 
+    //   it may also be in the memory map. Uses large pages where aligned.
+    UINT32 fb_map_flags = MAP_WRITE | MAP_GLOBAL;
+    if (arch_write_combine_supported()) {
+        fb_map_flags |= MAP_WRITE_COMBINE;
+        kparms.framebuffer_cache_type = EFI_MEMORY_WC;
+    } else {
+        fb_map_flags |= MAP_DEVICE;
+        kparms.framebuffer_cache_type = EFI_MEMORY_UC;
+    }
+    arch_map_range(kparms.gop_mode.FrameBufferBase, direct_map_base + kparms.gop_mode.FrameBufferBase, 
+                   kparms.gop_mode.FrameBufferSize, fb_map_flags, &boot_pa);
+
+    // Map all memory in the higher half direct map, instead of identity mapping it. Later
+    //   allocations only change memory types, not which memory is in the map.
+    //   With minimal mappings, only page tables are set up for it here, and the memory the 
+    //   kernel needs at entry is mapped below; the kernel maps the rest on page faults.
+    //   The map is kept to only patch in what's new in the final memory map.
+    if (EFI_ERROR(get_memory_map(&boot_mmap))) goto cleanup;
+    kparms.direct_map_base = direct_map_base;
+    if (minimal_mappings) {
+        reserve_efi_mmap(&boot_mmap, direct_map_base, &boot_pa);
+        kparms.paging_features |= PAGING_LAZY_DIRECT_MAP;
+    } else {
+        map_efi_mmap(&boot_mmap, direct_map_base, &boot_pa);
+    }
+    boot_stage("Direct map memory");
 
-    // Remap kernel to higher addresses
-    for (UINTN i = 0; i < (kernel_size + (PAGE_SIZE-1)) / PAGE_SIZE; i++) 
-        arch_map_page(kernel_buffer + (i*PAGE_SIZE), 
-                      KERNEL_START_ADDRESS + (i*PAGE_SIZE), 
-                      &kparms.mmap); 
+    // Remap kernel to higher addresses, with each segment's permissions
+    map_kernel_segments(kernel_buffer, kernel_size, KERNEL_START_ADDRESS, &kernel_segments, &boot_pa);
 
     // NOTE: TODO: Remap kparms to higher address?
 
-    // Identity map framebuffer
-    for (UINTN i = 0; i < (kparms.gop_mode.FrameBufferSize + (PAGE_SIZE-1)) / PAGE_SIZE; i++) 
-        identity_map_page(kparms.gop_mode.FrameBufferBase + (i*PAGE_SIZE), &kparms.mmap); 
+    // Identity map the code that switches to the new page tables and calls the kernel, as it 
+    //   keeps running from its physical address; this is the only low memory mapping, besides
+    //   any arch_init_page_tables() needs for e.g. a 5 level paging switch
+    UINTN trampoline = (UINTN)arch_setup_and_call_kernel & ~(UINTN)(PAGE_SIZE-1);
+    arch_map_range(trampoline, trampoline, 2 * PAGE_SIZE, MAP_EXECUTE, &boot_pa);
 
-    // Identity map new stack for kernel
+    // New stack for kernel, used through the direct map
     const UINTN STACK_PAGES = 16;   
-    void *kernel_stack = mmap_allocate_pages(&kparms.mmap, STACK_PAGES);   // 64KiB stack
+    void *kernel_stack = allocate_physical_pages(&boot_pa, STACK_PAGES);   // 64KiB stack
+    if (!kernel_stack) goto cleanup;
     uint32_t stack_size = STACK_PAGES * PAGE_SIZE;
     memset(kernel_stack, 0, stack_size); // Initialize stack memory
 
-    for (UINTN i = 0; i < STACK_PAGES; i++) 
-        identity_map_page((UINTN)kernel_stack + (i*PAGE_SIZE), &kparms.mmap); 
+    // Bitmap for the kernel's physical page allocator, allocated now so the final memory map 
+    //   has it as used memory; it's filled in from that map right before ExitBootServices()
+    UINT64 bitmap_pages = page_bitmap_pages(&boot_mmap);
+    uint64_t *page_bitmap = allocate_physical_pages(&boot_pa, bitmap_pages);
+    if (!page_bitmap) goto cleanup;
+
+    // Kernel parms are copied to loader memory for the kernel, as kparms is on the loader stack, 
+    //   which isn't direct mapped with minimal mappings
+    Kernel_Parms *kernel_parms = allocate_physical_pages(&boot_pa, (sizeof kparms + PAGE_SIZE-1) / PAGE_SIZE);
+    if (!kernel_parms) goto cleanup;
+
+    boot_stage("Build page tables");
+
+    // Get the final memory map, and finish everything that needs it before ExitBootServices(), so
+    //   only SetVirtualAddressMap() is left after. After a failed ExitBootServices() only 
+    //   GetMemoryMap() & ExitBootServices() can be called, so everything the loop needs is 
+    //   allocated first, from a memory map with the rest of loader memory already mapped:
+    //   - a memory map buffer with room for descriptors added from here on
+    //   - a runtime memory map buffer with room for all of those descriptors
+    //   - pool pages for page tables for each added descriptor, at most 2 tables per level for
+    //     its unaligned ends; the pool is then locked, so mapping can't grow it
+    if (EFI_ERROR(get_memory_map(&kparms.mmap))) goto cleanup;
+    if (minimal_mappings) map_kernel_entry_memory(&kparms.mmap, direct_map_base, &boot_pa);
+    else                  map_new_efi_mmap(&kparms.mmap, &boot_mmap, direct_map_base, &boot_pa);
+
+    const UINTN MMAP_SLACK = 32;
+    const UINTN mmap_capacity = kparms.mmap.size + (MMAP_SLACK * kparms.mmap.desc_size);
+    bs->FreePool(kparms.mmap.map);
+    kparms.mmap.map = NULL;
+    status = bs->AllocatePool(EfiLoaderData, mmap_capacity, (VOID **)&kparms.mmap.map);
+    if (EFI_ERROR(status)) {
+        error(status, u"Could not allocate buffer for final memory map\r\n");
+        goto cleanup;
+    }
+
+    EFI_MEMORY_DESCRIPTOR *runtime_mmap = 
+        allocate_physical_pages(&boot_pa, (mmap_capacity + (PAGE_SIZE-1)) / PAGE_SIZE);
+    if (!runtime_mmap) goto cleanup;
+    if (!reserve_pool_pages(&boot_pa, MMAP_SLACK * 2 * 4)) goto cleanup;
+    pool_locked = true;
+
+    Page_Allocator *pa = &kparms.page_allocator;
+    UINTN runtime_mmap_size = 0;
+    UINTN retries = 0;
+    const UINTN MAX_RETRIES = 5;
+    for (;;) {
+        kparms.mmap.size = mmap_capacity;
+        if (EFI_ERROR(bs->GetMemoryMap(&kparms.mmap.size, kparms.mmap.map, &kparms.mmap.key, 
+                                       &kparms.mmap.desc_size, &kparms.mmap.desc_version))) 
+            goto cleanup;
+
+        // Patch in memory only in the final memory map. With minimal mappings, map all loader 
+        //   memory instead: page tables, kernel stack, page bitmap & the memory map itself.
+        if (minimal_mappings) map_kernel_entry_memory(&kparms.mmap, direct_map_base, &boot_pa);
+        else                  map_new_efi_mmap(&kparms.mmap, &boot_mmap, direct_map_base, &boot_pa);
+
+        // Runtime services' new addresses in the direct map
+        runtime_mmap_size = build_runtime_address_map(&kparms.mmap, direct_map_base, runtime_mmap);
+
+        // Physical page allocator for the kernel, with the rest of the pool free in it
+        init_page_allocator(pa, &kparms.mmap, page_bitmap, bitmap_pages);
+        free_physical_pages(pa, (void *)boot_pa.pool, boot_pa.pool_pages);
+
+        if (!EFI_ERROR(bs->ExitBootServices(image, kparms.mmap.key))) break;
+
+        // Firmware could do a partial shutdown, need to get memory map again
+        //   and try exit boot services again 
+        if (++retries == MAX_RETRIES) {
+            error(0, u"Could not Exit Boot Services!\r\n");
+            goto cleanup;
+        }
+    }
+    boot_stage("ExitBootServices");
+
+    // Move runtime services to their direct map addresses; only allowed after ExitBootServices().
+    //   Can't print errors without boot services, and runtime services are optional for the
+    //   kernel, so keep going on failure.
+    set_runtime_address_map(&kparms.mmap, runtime_mmap, runtime_mmap_size);
+
+    boot_stage("Set virtual address map");
+    kparms.page_table_pages = arch_page_table_pages();
+    kparms.profile = boot_profile;  // Boot stage timeline for kernel
+
+    // Kernel only sees memory through the direct map, no more page allocations after this
+    direct_map_kernel_parms(&kparms);
+    memcpy(kernel_parms, &kparms, sizeof kparms);
 
     // Set page tables & paging, do other arch specific settings, and call kernel
-    arch_setup_and_call_kernel(higher_entry_point, kernel_stack, stack_size, &kparms);
+    arch_setup_and_call_kernel(higher_entry_point, kernel_stack, stack_size, kernel_parms);
 
     // Final cleanup
     cleanup:
-    if (disk_buffer) bs->FreePool(disk_buffer); // Free memory for data partition file
+    if (reads.count) wait_data_file_reads(&reads);  // Don't leave reads in flight to freed memory
+    close_data_file(&kernel_file);
+    if (disk_buffer) bs->FreePool(disk_buffer); // Free memory for kernel file headers
     if (pkg_list)    bs->FreePool(pkg_list);    // Free memory for simple font package list
 
     if (kparms.fonts) {
-        // Free memory for kparms font glyphs
-        for (UINTN i = 0; i < kparms.num_fonts; i++)    
-            bs->FreePool(kparms.fonts[i].glyphs);
+        // Free memory for EFI font glyphs; PSF font glyphs are in psf_buffer
+        if (kparms.fonts[0].glyphs) bs->FreePool(kparms.fonts[0].glyphs);
 
         bs->FreePool(kparms.fonts);   // Free memory for kparms fonts array
     }
 
+    // Free PSF font read from disk; one in the boot bundle is freed with it
+    close_data_file(&psf_file);
+    if (psf_pages) bs->FreePages(psf_buffer, psf_pages);
+
+    free_boot_bundle(&bundle);  // Free memory for boot bundle & kparms modules
+
+    // Free memory maps, and page tables & other kernel memory from the pool
+    if (boot_mmap.map)   bs->FreePool(boot_mmap.map);
+    if (kparms.mmap.map) bs->FreePool(kparms.mmap.map);
+    free_pool_pages(&boot_pa);
+
     return EFI_SUCCESS;
 }
 
@@ -2230,10 +2599,6 @@ EFI_STATUS install_to_disk(void) {
 // ===================================================
 EFI_STATUS write_to_another_disk(void) { 
     EFI_STATUS status = EFI_SUCCESS;
-    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
-    EFI_BLOCK_IO_PROTOCOL *biop;
-    UINTN num_handles = 0;
-    EFI_HANDLE *handle_buffer = NULL;
     EFI_BLOCK_IO_PROTOCOL *disk_image_bio = NULL, *chosen_disk_bio = NULL;
 
     cout->ClearScreen(cout);
@@ -2246,50 +2611,21 @@ EFI_STATUS write_to_another_disk(void) {
         return status;
     }
 
-    // Get size of disk image from file 
-    CHAR16 *file_name = u"\\EFI\\BOOT\\FILE.TXT";
-    UINTN buf_size = 0;
-    VOID *file_buffer = NULL;
-    file_buffer = read_esp_file_to_buffer(file_name, &buf_size);
-    if (!file_buffer) {
-        error(0, u"Could not find or read file '%s' to buffer\r\n", file_name);
-        return 1;
-    }
-
-    char *str_pos = strstr(file_buffer, "DISK_SIZE=");
-    if (!str_pos) {
-        error(0, u"Could not find disk image size in FILE.TXT\r\n");
-        return 1;
+    // Get size of disk image from data partition file index
+    status = build_data_partition_index();
+    if (EFI_ERROR(status) || data_index.disk_size == 0) {
+        error(status, u"Could not find disk image size in ESP file manifest\r\n");
+        return EFI_ERROR(status) ? status : EFI_NOT_FOUND;
     }
 
-    str_pos += strlen("DISK_SIZE=");
-    UINTN disk_image_size = atoi(str_pos);
-
-    // Free file buffer when done
-    bs->FreePool(file_buffer);
+    UINTN disk_image_size = data_index.disk_size;
 
     // Loop through and print all full disk Block IO protocol Media 
-    status = bs->LocateHandleBuffer(ByProtocol, &bio_guid, NULL, &num_handles, &handle_buffer);
-    if (EFI_ERROR(status)) {
-        error(status, u"Could not locate any Block IO Protocols.\r\n");
-        return status;
-    }
+    for (UINTN i = 0; i < disk_registry.num_devices; i++) {
+        EFI_BLOCK_IO_PROTOCOL *biop = disk_registry.devices[i].biop;
 
-    UINT32 last_media_id = -1;  // Keep track of currently opened Media info
-    for (UINTN i = 0; i < num_handles; i++) {
-        status = bs->OpenProtocol(handle_buffer[i], 
-                                  &bio_guid,
-                                  (VOID **)&biop,
-                                  image,
-                                  NULL,
-                                  EFI_OPEN_PROTOCOL_GET_PROTOCOL);  // Don't have to use CloseProtocol()
-        if (EFI_ERROR(status)) {
-            error(status, u"Could not Get Block IO protocol on handle %u.\r\n", i);
-            continue;
-        }
-
-        if (biop->Media->LastBlock == 0 || biop->Media->LogicalPartition ||
-            !biop->Media->MediaPresent  || biop->Media->ReadOnly) {
+        if (!biop || biop->Media->LastBlock == 0 ||
+            !biop->Media->MediaPresent || biop->Media->ReadOnly) {
             // Only care about partitions/disks above 1 block in size, 
             // Block IOs for the "whole" disk (not a logical partition), 
             // Media that is currently present,
@@ -2297,16 +2633,13 @@ EFI_STATUS write_to_another_disk(void) {
             continue;
         }
 
-        // Print Block IO Media Info for this Disk/partition
-        if (last_media_id != biop->Media->MediaId) {
-            last_media_id = biop->Media->MediaId;   
-            printf_c16(u"Media ID: %u %s\r\n", 
-                   last_media_id, 
-                   (last_media_id == disk_image_media_id ? u"(Disk Image)" : u""));
+        // Print Block IO Media Info for this Disk
+        printf_c16(u"Media ID: %u %s\r\n", 
+               biop->Media->MediaId, 
+               (biop->Media->MediaId == disk_image_media_id ? u"(Disk Image)" : u""));
 
-            if (last_media_id == disk_image_media_id) 
-                disk_image_bio = biop; // Save for later
-        }
+        if (biop->Media->MediaId == disk_image_media_id) 
+            disk_image_bio = biop; // Save for later
 
         // Get disk size in bytes, add 1 block for 0-based indexing fun
         UINTN size = (biop->Media->LastBlock+1) * biop->Media->BlockSize; 
@@ -2331,28 +2664,20 @@ EFI_STATUS write_to_another_disk(void) {
     printf_c16(u"\r\n");
 
     // Get Block IO for chosen disk media
-    bool found = false;
-    for (UINTN i = 0; i < num_handles; i++) {
-        status = bs->OpenProtocol(handle_buffer[i], 
-                                  &bio_guid,
-                                  (VOID **)&biop,
-                                  image,
-                                  NULL,
-                                  EFI_OPEN_PROTOCOL_GET_PROTOCOL);  // Don't have to use CloseProtocol()
-        if (EFI_ERROR(status)) {
-            error(status, u"Could not Get Block IO protocol on handle %u.\r\n", i);
-            continue;
-        }
-
-        if (biop->Media->MediaId == chosen_media) {
-            chosen_disk_bio = biop;
-            found = true;
-            break;
-        }
+    Disk_Device *chosen_device = find_disk_device(chosen_media);
+    if (chosen_device) chosen_disk_bio = chosen_device->biop;
+    if (!chosen_disk_bio) {
+        error(0, u"Could not find media with ID %u\r\n", chosen_media);
+        return 1;
     }
 
-    if (!found) {
-        error(0, u"Could not find media with ID %u\r\n", chosen_media);
+    // Disk image may not have been listed above if it is read only
+    if (!disk_image_bio) {
+        Disk_Device *image_device = find_disk_device(disk_image_media_id);
+        if (image_device) disk_image_bio = image_device->biop;
+    }
+    if (!disk_image_bio) {
+        error(0, u"Could not find Block IO for entire disk image disk\r\n");
         return 1;
     }
 
@@ -2423,6 +2748,9 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
     // Initialize global variables
     init_global_variables(ImageHandle, SystemTable);
 
+    // Start timing boot stages
+    boot_profile_start();
+
     // Reset Console Inputs/Outputs
     cin->Reset(cin, FALSE);
     cout->Reset(cout, FALSE);
@@ -2441,6 +2769,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
     // Set global text rows/cols values
     text_rows = rows; 
     text_cols = cols;
+    boot_stage("Console setup");
 
     // Check for "installed" file to autoload kernel instead of main menu, or not
     EFI_FILE_PROTOCOL *root = esp_root_dir();
@@ -2451,8 +2780,16 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
         status = root->Open(root, &file, path, EFI_FILE_MODE_READ, 0);
         autoload_kernel = !EFI_ERROR(status);
         if (file) file->Close(file);
+        file = NULL;
+
+        // Check for "minimal map" file, to only map what the kernel needs at entry; only if the 
+        //   kernel can map the rest on page faults
+        status = root->Open(root, &file, u"\\EFI\\BOOT\\MINMAP.DAT", EFI_FILE_MODE_READ, 0);
+        minimal_mappings = !EFI_ERROR(status) && arch_lazy_mapping_supported();
+        if (file) file->Close(file);
         if (root) root->Close(root);
     }
+    boot_stage("Open ESP & check autoload");
 
     if (autoload_kernel) load_kernel(); // Load kernel; Should not return!
 
@@ -2495,6 +2832,10 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
     // Connect all controllers found for all handles, to hopefully fix
     //   any bugs related to not initializing device drivers from firmware
     connect_all_controllers();
+    boot_stage("Connect controllers");
+
+    // New Block IO handles may have been connected, rebuild disk registry on next use
+    reset_disk_registry();
 
     // Timer function context will be the text mode screen bounds
     typedef struct {
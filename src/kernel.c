@@ -26,42 +26,149 @@ const uint32_t colors[COLOR_MAX] = {
     [DARK_GRAY]  = 0xFF222222, 
 };
 
-uint32_t *fb = NULL;  // Framebuffer
+uint32_t *screen = NULL;  // Framebuffer in video memory, only written by flush_screen()
+uint32_t *fb = NULL;  // Back buffer in RAM that everything is drawn to, or the framebuffer if none
 uint32_t xres = 0;    // X/Horizontal resolution of framebuffer
 uint32_t yres = 0;    // Y/Vertical resolution of framebuffer
-uint32_t x = 0;       // X offset into framebuffer
-uint32_t y = 0;       // Y offset into framebuffer
 
+// Rectangle of pixels, right & bottom exclusive
+typedef struct {
+    uint32_t left, top, right, bottom;
+} Rect;
+
+Rect dirty = {0};     // Back buffer area drawn since the last flush_screen(); empty if top >= bottom
+
+// Default text colors, for new console cells and glyph caches
 const uint32_t text_fg_color = 0xFFDDDDDD;//colors[LIGHT_GRAY];
 const uint32_t text_bg_color = 0xFF222222;//colors[DARK_GRAY];
 
-void print_string(char *string, Bitmap_Font *font);
+// Glyphs of a font pre-expanded to ARGB pixel rows in the current text colors, so drawing a 
+//   character is one row copy per glyph line. Glyphs in other colors are rasterized directly, 
+//   and the cache is only expanded again in new colors once they've been used for as many 
+//   glyphs as expanding costs, so frequent color changes don't re-expand it each time.
+#define MAX_FONTS     4
+#define CACHED_GLYPHS 256   // Glyphs for all 8 bit chars
+
+typedef struct {
+    Bitmap_Font *font;
+    uint32_t    fg_color;   // Colors the pixels were expanded with
+    uint32_t    bg_color;
+    uint32_t    *pixels;    // CACHED_GLYPHS glyphs of width * height pixels
+    uint32_t    miss_fg_color;  // Other colors glyphs were last rasterized in
+    uint32_t    miss_bg_color;
+    uint32_t    misses;         // Glyphs rasterized in a row in the miss colors
+} Glyph_Cache;
+
+Glyph_Cache glyph_caches[MAX_FONTS] = {0};
+
+// Text console: a grid of character cells the size of one font's glyphs. Rows are a ring 
+//   buffer, so scrolling moves the head row instead of copying cells. Writing text only changes
+//   cells; console_repaint() draws just the cells that changed since the last repaint, so bursts
+//   of output cost memory writes, and only the latest text reaches the framebuffer.
+typedef struct {
+    uint32_t codepoint;
+    uint32_t fg_color;
+    uint32_t bg_color;
+} Cell;
+
+typedef struct {
+    Bitmap_Font *font;
+    Cell     *cells;        // rows * cols; screen row r is ring buffer row (head + r) % rows
+    Cell     *drawn;        // Cells as last drawn to the back buffer, in screen order
+    uint32_t cols;
+    uint32_t rows;
+    uint32_t head;          // Ring buffer row at the top of the screen
+    uint32_t scrolled;      // Rows scrolled since the last repaint
+    uint32_t col;           // Cursor column
+    uint32_t row;           // Cursor screen row
+    uint32_t fg_color;      // Colors for new text
+    uint32_t bg_color;
+} Console;
+
+void print_string(Console *console, char *string);
+void console_write(Console *console, char *string);
+void console_repaint(Console *console);
+bool init_console(Console *console, Bitmap_Font *font, Kernel_Parms *kargs);
+void init_glyph_caches(Kernel_Parms *kargs);
+void mark_dirty(uint32_t left, uint32_t top, uint32_t right, uint32_t bottom);
+void flush_screen(void);
+void print_boot_profile(Boot_Profile *profile, Console *console);
 
 // ==============
 // MAIN
 // ==============
 __attribute__((section(".kernel"), aligned(0x1000))) 
 noreturn void EFIAPI kmain(Kernel_Parms *kargs) {
+    // Set up page table helpers from the loader's paging settings and recursive page table slot
+    arch_init_kernel_paging(kargs);
+
+    // Map the rest of the direct map on page faults, if the loader only mapped what's needed here
+    if (kargs->paging_features & PAGING_LAZY_DIRECT_MAP) arch_init_lazy_mapping(kargs);
+
     // Grab Framebuffer/GOP info
-    fb = (UINT32 *)kargs->gop_mode.FrameBufferBase;  
+    screen = (UINT32 *)(kargs->direct_map_base + kargs->gop_mode.FrameBufferBase);  
     xres = kargs->gop_mode.Info->PixelsPerScanLine;
     yres = kargs->gop_mode.Info->VerticalResolution;
 
+    // Draw to a back buffer in RAM, and only copy changed areas to the framebuffer, so drawing 
+    //   and scrolling use cached memory and never read video memory
+    UINTN fb_pages = (((UINTN)xres * yres * 4) + (PAGE_SIZE-1)) / PAGE_SIZE;
+    void *back_buffer = allocate_physical_pages(&kargs->page_allocator, fb_pages);
+    fb = back_buffer ? (UINT32 *)(kargs->direct_map_base + (UINTN)back_buffer) : screen;
+
     // Clear screen to solid color
     UINTN color = colors[DARK_GRAY];
-    for (y = 0; y < yres; y++) 
-        for (x = 0; x < xres; x++) 
-            fb[y*xres + x] = color;
+    for (UINTN px = 0; px < (UINTN)xres * yres; px++) 
+        fb[px] = color;
+    mark_dirty(0, 0, xres, yres);
+    flush_screen();
 
-    // Print test string(s)
-    x = y = 0;  // Reset to 0,0 position
+    init_glyph_caches(kargs);
+
+    // Text console in font 1; its cells start out blank in the screen's background color
     Bitmap_Font *font1 = &kargs->fonts[0];
     Bitmap_Font *font2 = &kargs->fonts[1];
-    print_string("Hello, kernel bitmap font world!", font1);
-    print_string("\r\nFont 1 Name: ", font1);
-    print_string(font1->name, font1);
-    print_string("\r\nFont 2 Name: ", font2);
-    print_string(font2->name, font2);
+    Console console = {0};
+    if (!init_console(&console, font1, kargs)) while (true) arch_cpu_halt();
+
+    // Print test string(s)
+    print_string(&console, "Hello, kernel bitmap font world!");
+    print_string(&console, "\r\nFont 1 Name: ");
+    print_string(&console, font1->name);
+    print_string(&console, "\r\nFont 2 Name: ");
+    print_string(&console, font2->name);
+
+    // Print names of modules loaded from the boot bundle, if any
+    for (UINTN m = 0; m < kargs->num_modules; m++) {
+        print_string(&console, "\r\nModule: ");
+        print_string(&console, kargs->modules[m].name);
+    }
+
+    // Print loader boot stage timings passed from the bootloader
+    print_boot_profile(&kargs->profile, &console);
+
+    char buf[64];
+    sprintf(buf, "\r\nPage table pages: %llu", (uint64_t)kargs->page_table_pages);
+    print_string(&console, buf);
+
+    sprintf(buf, "\r\nFramebuffer: %s", 
+            kargs->framebuffer_cache_type == EFI_MEMORY_WC ? "write combining" : "uncached");
+    print_string(&console, buf);
+
+    sprintf(buf, "\r\nPaging: %llu levels, recursive slot %llu, global pages %s, PCID %s, PAT %s", 
+            (uint64_t)kargs->paging_levels, (uint64_t)kargs->recursive_slot,
+            (kargs->paging_features & PAGING_GLOBAL_PAGES) ? "on" : "off",
+            (kargs->paging_features & PAGING_PCID) ? "on" : "off",
+            (kargs->paging_features & PAGING_PAT) ? "on" : "off");
+    print_string(&console, buf);
+
+    // Test physical page allocator handed off from the bootloader
+    Page_Allocator *pa = &kargs->page_allocator;
+    void *page = allocate_physical_pages(pa, 1);
+    sprintf(buf, "\r\nFree memory: %llu MiB, test page: %#llx", 
+            (pa->free_pages * PAGE_SIZE) / (1024*1024), (uint64_t)page);
+    print_string(&console, buf);
+    if (page) free_physical_pages(pa, page, 1);
 
     // Test runtime services by waiting a few seconds and then shutting down
     EFI_TIME old_time = {0}, new_time = {0};
@@ -88,93 +195,267 @@ noreturn void EFIAPI kmain(Kernel_Parms *kargs) {
     //__builtin_unreachable();
 }
 
+// =====================================================================
+// Print time spent in each bootloader boot stage, in microseconds.
+//   Each stage is the time since the previous stage (or profiler start)
+// =====================================================================
+void print_boot_profile(Boot_Profile *profile, Console *console) {
+    if (profile->ticks_per_second == 0) return; // Profiler was not started
+
+    char buf[128];
+    uint64_t last = profile->start;
+    console_write(console, "\r\n\r\nBoot stages (us):");
+    for (uint32_t i = 0; i < profile->num_stages; i++) {
+        Boot_Stage *stage = &profile->stages[i];
+        sprintf(buf, "\r\n%s: %llu", stage->name,
+                ((stage->ticks - last) * 1000000) / profile->ticks_per_second);
+        console_write(console, buf);
+        last = stage->ticks;
+    }
+
+    // Draw all lines at once
+    sprintf(buf, "\r\nTotal: %llu",
+            ((last - profile->start) * 1000000) / profile->ticks_per_second);
+    print_string(console, buf);
+}
+
 // ======================================================================
-// Print a line feed visually (go down 1 line and/or scroll the screen)
+// Add an area of the back buffer to the dirty rectangle, to be copied to
+//   the framebuffer on the next flush_screen()
 // ======================================================================
-void line_feed(Bitmap_Font *font) {
-    // Can we draw another line of characters below current line?
-    if (y + font->height < yres - font->height) y += font->height; // Yes, go down 1 line 
-    else {
-        // No more room, move all lines on screen 1 row up by overwriting 1st line with lines 2+
-        // NOTE: This is probably slow due to reading and writing to framebuffer
-        uint32_t char_line_px    = xres * font->height;
-        uint32_t char_line_bytes = char_line_px * 4;    // Assuming ARGB8888
-        uint32_t char_lines      = yres / font->height;
+void mark_dirty(uint32_t left, uint32_t top, uint32_t right, uint32_t bottom) {
+    if (dirty.top >= dirty.bottom) {
+        dirty = (Rect){left, top, right, bottom};
+        return;
+    }
 
-        memcpy(fb, fb + char_line_px, char_line_bytes * (char_lines-1)); 
+    dirty.left   = min(dirty.left, left);
+    dirty.top    = min(dirty.top, top);
+    dirty.right  = max(dirty.right, right);
+    dirty.bottom = max(dirty.bottom, bottom);
+}
 
-        // Blank out last row by making all pixels the background color 
-        // Get X,Y start of last character line 
-        uint32_t px = ((yres / font->height) - 1) * font->height * xres; 
-        for (uint32_t i = 0; i < char_line_px; i++)
-            fb[px++] = text_bg_color;
+// ======================================================================
+// Copy the dirty rectangle from the back buffer to the framebuffer; only
+//   changed scanlines, and only the changed part of each. Full width
+//   rectangles are one contiguous copy.
+// ======================================================================
+void flush_screen(void) {
+    if (fb != screen && dirty.top < dirty.bottom) {
+        uint32_t right  = min(dirty.right, xres);
+        uint32_t bottom = min(dirty.bottom, yres);
+        if (dirty.left == 0 && right == xres) {
+            arch_copy_to_framebuffer(&screen[dirty.top*xres], &fb[dirty.top*xres], 
+                                     (uint64_t)(bottom - dirty.top) * xres);
+        } else {
+            for (uint32_t row = dirty.top; row < bottom; row++)
+                arch_copy_to_framebuffer(&screen[row*xres + dirty.left], &fb[row*xres + dirty.left], 
+                                         right - dirty.left);
+        }
     }
+
+    dirty = (Rect){0};
 }
 
-// ===========================================================
-// Print a bitmapped font string to the screen (framebuffer)
-// ===========================================================
-void print_string(char *string, Bitmap_Font *font) {
-    uint32_t glyph_size = ((font->width + 7) / 8) * font->height;   // Size of all glyph lines
-    uint32_t glyph_width_bytes = (font->width + 7) / 8;             // Size of 1 line of a glyph
-    for (char c = *string++; c != '\0'; c = *string++) {
-        if (c == '\r') { x = 0; continue; }             // Carriage return (CR)
-        if (c == '\n') { line_feed(font); continue; }   // Line Feed (LF) 
-
-        uint8_t *glyph = &font->glyphs[c * glyph_size];
-
-        // Draw each line of glyph
-        for (uint32_t i = 0; i < font->height; i++) {
-            // e.g. for glyph 'F':
-            // Left to right 1 bits:      Right to left 1 bits:
-            // mask starts here ------v   mask starts here ------v
-            // data starts here ->11111   data starts here ->11111
-            //                    1                              1
-            //                    111                          111
-            //                    1                              1
-            //                    1                              1
-            // The bitmask starts at the font width and goes down to 0, which ends up 
-            //   drawing the bits mirrored from how they are stored in memory.
-            //   We want to byteswap the bits if it is already stored left to right, so that 
-            //   drawing it mirrored will be left to right visually, not right to left.
-            // NOTE: This only works for fonts <= 64 pixels in width, and assumes font data
-            //    is padded with 0s to not overflow, if last line of character data is less than 8 bytes.
-            uint64_t mask = 1 << (font->width-1);
-            uint64_t bytes = font->left_col_first ? 
-                             ((uint64_t)glyph[0] << 56) | // Byteswap character data; can 
-                             ((uint64_t)glyph[1] << 48) | //   also use __builtin_bswap64(*(uint64_t *)glyph)
-                             ((uint64_t)glyph[2] << 40) | 
-                             ((uint64_t)glyph[3] << 32) |
-                             ((uint64_t)glyph[4] << 24) |
-                             ((uint64_t)glyph[5] << 16) | 
-                             ((uint64_t)glyph[6] <<  8) |
-                             ((uint64_t)glyph[7] <<  0) 
-                             : *(uint64_t *)glyph;   // Else pixels are stored right to left
-            for (uint32_t px = 0; px < font->width; px++) {
-                fb[y*xres + x] = bytes & mask ? text_fg_color : text_bg_color;
-                mask >>= 1;
-                x++;            // Next pixel of character
-            }
-            y++;                // Next line of character
-            x -= font->width;   // Back up to start of character 
-            glyph += glyph_width_bytes;
-        }
+// ======================================================================
+// Expand all cached glyphs of a font to pixels in fg/bg colors
+// ======================================================================
+void expand_glyphs(Glyph_Cache *cache, uint32_t fg_color, uint32_t bg_color) {
+    Bitmap_Font *font = cache->font;
+    const uint32_t glyph_size = ((font->width + 7) / 8) * font->height;
+    const uint32_t glyph_px   = font->width * font->height;
+
+    for (uint32_t g = 0; g < min(CACHED_GLYPHS, font->num_glyphs); g++)
+        arch_expand_glyph(&cache->pixels[g * glyph_px], font->width, font, &font->glyphs[g * glyph_size], 
+                          fg_color, bg_color);
+
+    cache->fg_color = fg_color;
+    cache->bg_color = bg_color;
+    cache->misses   = 0;
+}
+
+// ======================================================================
+// Allocate a glyph cache for each font at console init. Fonts without
+//   one, e.g. if memory ran out, are drawn from their bitmaps instead.
+// ======================================================================
+void init_glyph_caches(Kernel_Parms *kargs) {
+    for (UINTN i = 0; i < min(kargs->num_fonts, (UINTN)MAX_FONTS); i++) {
+        Bitmap_Font *font = &kargs->fonts[i];
+        if (!font->glyphs || font->num_glyphs == 0 || font->width == 0 || font->width > 64) continue;
+
+        UINTN bytes = (UINTN)CACHED_GLYPHS * font->width * font->height * 4;
+        void *pixels = allocate_physical_pages(&kargs->page_allocator, (bytes + (PAGE_SIZE-1)) / PAGE_SIZE);
+        if (!pixels) continue;
 
-        // Go to start of next character, top left pixel
-        y -= font->height;      
-        if (x + font->width < xres - font->width) x += font->width; 
-        else {
-            // Wrap text to next line with a CR/LF
-            x = 0;
-            line_feed(font);
+        glyph_caches[i] = (Glyph_Cache){
+            .font   = font,
+            .pixels = (uint32_t *)(kargs->direct_map_base + (UINTN)pixels),
+        };
+        expand_glyphs(&glyph_caches[i], text_fg_color, text_bg_color);
+    }
+}
+
+// Get the glyph cache for a font, or NULL if it has none
+Glyph_Cache *find_glyph_cache(Bitmap_Font *font) {
+    for (uint32_t i = 0; i < MAX_FONTS; i++)
+        if (glyph_caches[i].font == font) return &glyph_caches[i];
+    return NULL;
+}
+
+// ======================================================================
+// Draw one character with its top left pixel at x,y in the back buffer. 
+//   With a glyph cache in the same colors that is one row copy per line;
+//   otherwise the glyph is rasterized from its bitmap with SIMD if 
+//   available.
+// ======================================================================
+void draw_glyph(uint8_t c, Bitmap_Font *font, uint32_t x, uint32_t y, uint32_t fg_color, uint32_t bg_color) {
+    uint32_t *dst = &fb[y*xres + x];
+    if (c >= min(CACHED_GLYPHS, font->num_glyphs)) c = 0;   // Not in the font, draw glyph 0
+
+    Glyph_Cache *cache = find_glyph_cache(font);
+    if (cache && (cache->fg_color != fg_color || cache->bg_color != bg_color)) {
+        // Count glyphs drawn in a row in these colors, and switch the cache to them when that 
+        //   pays for expanding it
+        if (cache->miss_fg_color != fg_color || cache->miss_bg_color != bg_color) {
+            cache->miss_fg_color = fg_color;
+            cache->miss_bg_color = bg_color;
+            cache->misses = 0;
         }
+        if (++cache->misses >= CACHED_GLYPHS) expand_glyphs(cache, fg_color, bg_color);
+    }
+
+    if (cache && cache->fg_color == fg_color && cache->bg_color == bg_color) {
+        uint32_t *src = &cache->pixels[c * font->width * font->height];
+        for (uint32_t i = 0; i < font->height; i++, dst += xres, src += font->width)
+            memcpy(dst, src, font->width * 4);
+        return;
     }
+
+    const uint32_t glyph_size = ((font->width + 7) / 8) * font->height;
+    arch_expand_glyph(dst, xres, font, &font->glyphs[c * glyph_size], fg_color, bg_color);
 }
 
+// ======================================================================
+// Set up a console filling the screen with cells of a font's glyph size,
+//   all blank in the default text colors, which is what the cleared 
+//   screen already shows
+// ======================================================================
+bool init_console(Console *console, Bitmap_Font *font, Kernel_Parms *kargs) {
+    if (!font->glyphs || font->num_glyphs == 0 || font->width == 0 || font->height == 0 || 
+        font->width > xres || font->height > yres)
+        return false;
 
+    const uint32_t cols = xres / font->width;
+    const uint32_t rows = yres / font->height;
+    const UINTN pages = (((UINTN)cols * rows * sizeof(Cell) * 2) + (PAGE_SIZE-1)) / PAGE_SIZE;
+    void *cells = allocate_physical_pages(&kargs->page_allocator, pages);
+    if (!cells) return false;
 
+    *console = (Console){
+        .font     = font,
+        .cells    = (Cell *)(kargs->direct_map_base + (UINTN)cells),
+        .cols     = cols,
+        .rows     = rows,
+        .fg_color = text_fg_color,
+        .bg_color = text_bg_color,
+    };
+    console->drawn = console->cells + ((UINTN)cols * rows);
 
+    const Cell blank = {' ', text_fg_color, text_bg_color};
+    for (UINTN i = 0; i < (UINTN)cols * rows; i++) 
+        console->cells[i] = console->drawn[i] = blank;
+    return true;
+}
 
+// Get the cells of a screen row, from the ring buffer
+Cell *console_row(Console *console, uint32_t row) {
+    return &console->cells[((console->head + row) % console->rows) * console->cols];
+}
 
+// ======================================================================
+// Go to the start of the next line. At the bottom of the screen this 
+//   scrolls by moving the head of the ring buffer down a row, and blanks
+//   the row that comes around as the new bottom line.
+// ======================================================================
+void console_new_line(Console *console) {
+    console->col = 0;
+    if (console->row + 1 < console->rows) {
+        console->row++;
+        return;
+    }
 
+    console->head = (console->head + 1) % console->rows;
+    console->scrolled = min(console->scrolled + 1, console->rows);
 
+    Cell *cells = console_row(console, console->row);
+    for (uint32_t col = 0; col < console->cols; col++)
+        cells[col] = (Cell){' ', console->fg_color, console->bg_color};
+}
+
+// ======================================================================
+// Write a string to the console's cells, without drawing anything
+// ======================================================================
+void console_write(Console *console, char *string) {
+    for (char c = *string++; c != '\0'; c = *string++) {
+        if (c == '\r') { console->col = 0; continue; }             // Carriage return (CR)
+        if (c == '\n') { console_new_line(console); continue; }    // Line Feed (LF) 
+
+        console_row(console, console->row)[console->col] = 
+            (Cell){(uint8_t)c, console->fg_color, console->bg_color};
+
+        // Wrap text to next line with a CR/LF
+        if (++console->col >= console->cols) console_new_line(console);
+    }
+}
+
+// ======================================================================
+// Draw cells that changed since the last repaint to the back buffer, and
+//   flush them to the framebuffer. Scrolling is applied first by moving 
+//   the back buffer's pixels & drawn cells up once for all rows scrolled,
+//   so only new lines and changed cells are drawn.
+// ======================================================================
+void console_repaint(Console *console) {
+    Bitmap_Font *font = console->font;
+    const uint32_t cols = console->cols, rows = console->rows;
+
+    if (console->scrolled > 0) {
+        const uint32_t kept = rows - console->scrolled;     // Rows still on screen
+        const UINTN row_px  = (UINTN)xres * font->height;
+        memmove(fb, fb + (console->scrolled * row_px), kept * row_px * 4);
+        memmove(console->drawn, console->drawn + ((UINTN)console->scrolled * cols), 
+               (UINTN)kept * cols * sizeof(Cell));
+
+        // Force the new rows to be drawn
+        for (UINTN i = (UINTN)kept * cols; i < (UINTN)rows * cols; i++) 
+            console->drawn[i].codepoint = UINT32_MAX;
+
+        if (kept > 0) mark_dirty(0, 0, xres, kept * font->height);
+        console->scrolled = 0;
+    }
+
+    for (uint32_t row = 0; row < rows; row++) {
+        Cell *cells = console_row(console, row);
+        Cell *drawn = &console->drawn[(UINTN)row * cols];
+        for (uint32_t col = 0; col < cols; col++) {
+            Cell cell = cells[col];
+            if (cell.codepoint == drawn[col].codepoint && cell.fg_color == drawn[col].fg_color && 
+                cell.bg_color == drawn[col].bg_color) 
+                continue;
+
+            uint32_t x = col * font->width, y = row * font->height;
+            draw_glyph((uint8_t)cell.codepoint, font, x, y, cell.fg_color, cell.bg_color);
+            mark_dirty(x, y, x + font->width, y + font->height);
+            drawn[col] = cell;
+        }
+    }
+
+    flush_screen();
+}
+
+// ===========================================================
+// Print a bitmapped font string to the screen (framebuffer)
+// ===========================================================
+void print_string(Console *console, char *string) {
+    console_write(console, string);
+    console_repaint(console);
+}
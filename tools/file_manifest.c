@@ -0,0 +1,188 @@
+// file_manifest.c: Host tool to write the binary file manifest (FILE.BIN) for the loader, with
+//   CRC32C checksums of data partition files. Reads FILE.TXT from the disk image program for
+//   each file's LBA & size, and the files themselves for their checksums.
+//
+// Usage: file_manifest <FILE.TXT> <FILE.BIN> <data files...>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Same layout as Data_Manifest_Header/Data_Manifest_Entry in efi_lib.h
+#define DATA_FILE_NAME_LEN 48
+#define DATA_MANIFEST_MAGIC 0x58444946  // "FIDX"
+#define DATA_MANIFEST_HAS_CHECKSUM 0x1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t entry_size;
+    uint64_t disk_size;
+} Data_Manifest_Header;
+
+typedef struct {
+    char     name[DATA_FILE_NAME_LEN];
+    uint64_t disk_lba;
+    uint64_t size;
+    uint32_t checksum;
+    uint32_t flags;
+} Data_Manifest_Entry;
+
+#define MAX_ENTRIES 256
+
+// ===============================================================
+// Update a running CRC32C value, same as crc32c_update() in the
+//   loader. Start with 0xFFFFFFFF and invert the final value.
+// ===============================================================
+uint32_t crc32c_update(uint32_t crc, uint8_t *buffer, size_t len) {
+    static uint32_t table[256] = {0};
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++)
+                value = (value >> 1) ^ (0x82F63B78 & -(value & 1));     // Reversed polynomial
+            table[i] = value;
+        }
+    }
+
+    for (; len > 0; len--, buffer++)
+        crc = table[(crc ^ *buffer) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+// ===============================================================
+// Get CRC32C of a whole file, and check its size matches the
+//   manifest. Returns 0 on error.
+// ===============================================================
+int file_checksum(char *path, uint64_t size, uint32_t *checksum) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Could not open data file '%s'\n", path);
+        return 0;
+    }
+
+    uint8_t buffer[64 * 1024];
+    uint32_t crc = 0xFFFFFFFF;
+    uint64_t total = 0;
+    size_t len = 0;
+    while ((len = fread(buffer, 1, sizeof buffer, fp)) > 0) {
+        crc = crc32c_update(crc, buffer, len);
+        total += len;
+    }
+    fclose(fp);
+
+    if (total != size) {
+        fprintf(stderr, "Data file '%s' is %llu bytes, manifest has %llu\n",
+                path, (unsigned long long)total, (unsigned long long)size);
+        return 0;
+    }
+
+    *checksum = crc ^ 0xFFFFFFFF;
+    return 1;
+}
+
+// ===============================================================
+// Parse FILE.TXT lines of "KEY=VALUE", where FILE_NAME= (or a
+//   line without '=') starts a new file, like parse_file_txt() in
+//   the loader. Returns number of entries, or -1 on error.
+// ===============================================================
+int parse_file_txt(FILE *fp, Data_Manifest_Entry *entries, uint64_t *disk_size) {
+    char line[256];
+    int count = 0;
+    Data_Manifest_Entry *entry = NULL;
+
+    while (fgets(line, sizeof line, fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0]) continue;
+
+        char *equals = strchr(line, '=');
+        char *name = NULL;
+        if (!equals) name = line;
+        else if (!strncmp(line, "FILE_NAME=", 10)) name = equals + 1;
+
+        if (name) {
+            if (count == MAX_ENTRIES) {
+                fprintf(stderr, "Too many files in manifest, max %d\n", MAX_ENTRIES);
+                return -1;
+            }
+            entry = &entries[count++];
+            memset(entry, 0, sizeof *entry);
+            size_t name_len = strlen(name);
+            if (name_len >= DATA_FILE_NAME_LEN) name_len = DATA_FILE_NAME_LEN-1;
+            memcpy(entry->name, name, name_len);
+        } else if (!strncmp(line, "DISK_SIZE=", 10)) {
+            *disk_size = strtoull(equals + 1, NULL, 10);
+        } else if (entry && !strncmp(line, "FILE_SIZE=", 10)) {
+            entry->size = strtoull(equals + 1, NULL, 10);
+        } else if (entry && !strncmp(line, "DISK_LBA=", 9)) {
+            entry->disk_lba = strtoull(equals + 1, NULL, 10);
+        }
+    }
+
+    return count;
+}
+
+// ==============
+// MAIN
+// ==============
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <FILE.TXT> <FILE.BIN> <data files...>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *txt = fopen(argv[1], "r");
+    if (!txt) {
+        fprintf(stderr, "Could not open text manifest '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    static Data_Manifest_Entry entries[MAX_ENTRIES];
+    uint64_t disk_size = 0;
+    int num_entries = parse_file_txt(txt, entries, &disk_size);
+    fclose(txt);
+    if (num_entries < 0) return EXIT_FAILURE;
+
+    // Checksum each data file given, matched to its manifest entry by file name
+    for (int i = 3; i < argc; i++) {
+        char *name = strrchr(argv[i], '/');
+        name = name ? name + 1 : argv[i];
+
+        Data_Manifest_Entry *entry = NULL;
+        for (int j = 0; j < num_entries && !entry; j++)
+            if (!strcmp(entries[j].name, name)) entry = &entries[j];
+
+        if (!entry) {
+            fprintf(stderr, "Data file '%s' is not in '%s'\n", name, argv[1]);
+            return EXIT_FAILURE;
+        }
+
+        if (!file_checksum(argv[i], entry->size, &entry->checksum)) return EXIT_FAILURE;
+        entry->flags |= DATA_MANIFEST_HAS_CHECKSUM;
+    }
+
+    Data_Manifest_Header hdr = {
+        .magic       = DATA_MANIFEST_MAGIC,
+        .version     = 1,
+        .num_entries = num_entries,
+        .entry_size  = sizeof(Data_Manifest_Entry),
+        .disk_size   = disk_size,
+    };
+
+    FILE *bin = fopen(argv[2], "wb");
+    if (!bin) {
+        fprintf(stderr, "Could not create binary manifest '%s'\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    int ok = fwrite(&hdr, sizeof hdr, 1, bin) == 1 &&
+             fwrite(entries, sizeof *entries, num_entries, bin) == (size_t)num_entries;
+    if (fclose(bin) != 0 || !ok) {
+        fprintf(stderr, "Could not write binary manifest '%s'\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}